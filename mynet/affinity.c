@@ -0,0 +1,87 @@
+/*
+  affinity.c
+  ワーカーのCPUへの固定と、ワーカーごとのバッファの確保
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+#include "mynet.h"
+#include <sys/mman.h>
+
+int cpu_count(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return(n > 0 ? (int)n : 1);
+}
+
+int pin_cpu(int cpu)
+{
+#ifdef __linux__
+  cpu_set_t set;
+
+  /* pid 0 は呼び出したスレッドだけを指す */
+  CPU_ZERO(&set);
+  CPU_SET(cpu % cpu_count(), &set);
+  return(sched_setaffinity(0, sizeof(set), &set));
+#else
+  (void)cpu;
+  return(-1);
+#endif
+}
+
+int incoming_cpu(int sock)
+{
+#ifdef SO_INCOMING_CPU
+  int cpu;
+  socklen_t len = sizeof(cpu);
+
+  if( getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 ){
+    return(cpu);
+  }
+#else
+  (void)sock;
+#endif
+  return(-1);
+}
+
+int set_incoming_cpu(int sock, int cpu)
+{
+#ifdef SO_INCOMING_CPU
+  /* SO_REUSEPORTのグループでは、パケットを受けたCPUと同じ値の
+     リスニングソケットが優先して選ばれる */
+  return(setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)));
+#else
+  (void)sock;
+  (void)cpu;
+  return(-1);
+#endif
+}
+
+void *alloc_local(size_t size)
+{
+  char *p;
+  long page = sysconf(_SC_PAGESIZE);
+  size_t i;
+
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if( p == MAP_FAILED ){
+    return(NULL);
+  }
+
+  /* ページは最初に書き込んだCPUのNUMAノードに置かれるので、
+     CPUに固定したあとで、そのスレッド自身が全ページに触れておく */
+  for( i = 0; i < size; i += page ){
+    p[i] = 0;
+  }
+  return(p);
+}
+
+void free_local(void *p, size_t size)
+{
+  if( p != NULL ){
+    munmap(p, size);
+  }
+}
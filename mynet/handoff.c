@@ -0,0 +1,212 @@
+/*
+  handoff.c
+  Unixドメインソケット経由のソケットの引き継ぎ (無停止での入れ替え用)
+*/
+
+#include "mynet.h"
+#include <stdint.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+
+static void set_sockaddr_un(struct sockaddr_un *adrs, const char *path)
+{
+  memset(adrs, 0, sizeof(*adrs));
+  adrs->sun_family = AF_UNIX;
+  snprintf(adrs->sun_path, sizeof(adrs->sun_path), "%s", path);
+}
+
+int handoff_server(const char *path)
+{
+  struct sockaddr_un my_adrs;
+  int sock;
+
+  set_sockaddr_un(&my_adrs, path);
+
+  if((sock = socket(PF_UNIX, SOCK_STREAM, 0)) == -1){
+    exit_errmesg("socket()");
+  }
+
+  /* 前のプロセスが残したパスは引き継ぎが終わっているので消してよい */
+  unlink(path);
+  if(bind(sock, (struct sockaddr *)&my_adrs, sizeof(my_adrs)) == -1){
+    exit_errmesg("bind()");
+  }
+  if(listen(sock, 1) == -1){
+    exit_errmesg("listen()");
+  }
+
+  return(sock);
+}
+
+int handoff_connect(const char *path)
+{
+  struct sockaddr_un server_adrs;
+  int sock;
+
+  set_sockaddr_un(&server_adrs, path);
+
+  if((sock = socket(PF_UNIX, SOCK_STREAM, 0)) == -1){
+    exit_errmesg("socket()");
+  }
+
+  /* 古いプロセスが動いていなければ-1を返し、呼び出し側は普通に起動する */
+  if(connect(sock, (struct sockaddr *)&server_adrs, sizeof(server_adrs)) == -1){
+    close(sock);
+    return(-1);
+  }
+
+  return(sock);
+}
+
+int handoff_send(int sock, int fd, const void *data, size_t len)
+{
+  struct msghdr msg;
+  struct iovec iov[2];
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } cmsg;
+  uint32_t size = len;
+
+  /* ストリームなので、データの前に長さを付けて区切る */
+  iov[0].iov_base = &size;
+  iov[0].iov_len = sizeof(size);
+  iov[1].iov_base = (void *)data;
+  iov[1].iov_len = len;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  /* fdはSCM_RIGHTSで送る (受け取った側では別の番号になる) */
+  if( fd >= 0 ){
+    memset(&cmsg, 0, sizeof(cmsg));
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+    cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+    cmsg.hdr.cmsg_level = SOL_SOCKET;
+    cmsg.hdr.cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(&cmsg.hdr), &fd, sizeof(int));
+  }
+
+  if( sendmsg(sock, &msg, 0) != (ssize_t)(sizeof(size) + len) ){
+    perror("sendmsg()");
+    return(-1);
+  }
+
+  return(0);
+}
+
+/* 受け取れなかったレコードのfdは新しいプロセスに残さない */
+static int recv_failed(int *fd)
+{
+  if( *fd >= 0 ){
+    close(*fd);
+    *fd = -1;
+  }
+  return(-1);
+}
+
+int handoff_recv(int sock, int *fd, void *data, size_t size)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *hdr;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } cmsg;
+  uint32_t len;
+  ssize_t r;
+
+  iov.iov_base = &len;
+  iov.iov_len = sizeof(len);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg.buf;
+  msg.msg_controllen = sizeof(cmsg.buf);
+
+  /* fdは長さの先頭バイトといっしょに届く */
+  *fd = -1;
+  r = recvmsg(sock, &msg, MSG_WAITALL);
+  if( r > 0 ){
+    for( hdr = CMSG_FIRSTHDR(&msg); hdr != NULL; hdr = CMSG_NXTHDR(&msg, hdr) ){
+      if( hdr->cmsg_level == SOL_SOCKET && hdr->cmsg_type == SCM_RIGHTS ){
+        memcpy(fd, CMSG_DATA(hdr), sizeof(int));
+      }
+    }
+  }
+
+  if( r != sizeof(len) ){
+    if( r != 0 ) perror("recvmsg()");
+    return(recv_failed(fd));
+  }
+  if( len > size ){
+    fprintf(stderr, "handoff_recv(): record too large (%u bytes)\n", (unsigned)len);
+    return(recv_failed(fd));
+  }
+  if( len > 0 && recv(sock, data, len, MSG_WAITALL) != (ssize_t)len ){
+    perror("recv()");
+    return(recv_failed(fd));
+  }
+
+  return(len);
+}
+
+int handoff_accept(int sock)
+{
+  struct timeval tv = { HANDOFF_TIMEOUT_SEC, 0 };
+  int conn;
+
+  if( (conn = accept(sock, NULL, NULL)) == -1 ){
+    perror("accept()");
+    return(-1);
+  }
+  /* 新しいプロセスが止まっても、古いプロセスは期限が来たら入れ替えをやめて動き続ける */
+  setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  return(conn);
+}
+
+int handoff_send_outq(int sock, const outq *q)
+{
+  char buf[HANDOFF_CHUNK];
+  size_t off, n;
+
+  for( off = 0; off < q->bytes; off += n ){
+    n = outq_copy(q, off, buf, sizeof(buf));
+    if( handoff_send(sock, -1, buf, n) == -1 ){
+      return(-1);
+    }
+  }
+  return(0);
+}
+
+int handoff_recv_outq(int sock, outq *q, size_t bytes)
+{
+  char buf[HANDOFF_CHUNK];
+  outmsg *m;
+  int fd, n;
+
+  while( bytes > 0 ){
+    if( (n = handoff_recv(sock, &fd, buf, sizeof(buf))) <= 0 || (size_t)n > bytes ){
+      return(-1);
+    }
+    if( fd != -1 ){
+      close(fd);
+    }
+    bytes -= n;
+    if( q == NULL ){
+      continue;
+    }
+    m = outmsg_bytes(buf, n);
+    n = outq_push(q, m, outq_now());
+    outmsg_release(m);
+    if( n == -1 ){
+      return(-1);
+    }
+  }
+  return(0);
+}
@@ -9,8 +9,11 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
-int broadcast_helo(int udp_sock, struct sockaddr_in *broadcast_adrs, char *server_ip, size_t server_ip_size);
+int broadcast_helo(int udp_sock, struct sockaddr_in *broadcast_adrs, char *server_ip, size_t server_ip_size, in_port_t *server_port);
 void handle_client(int tcp_sock, char *username);
 
 // Function declarations for TCP server and client
@@ -32,4 +35,113 @@ int Recvfrom(int sock, void *r_buf, size_t len, int flags, struct sockaddr *from
 // Function declaration for error handling
 void exit_errmesg(char *errmesg);
 
+// Token bucket for per-client rate limiting
+typedef struct {
+    double rate;    /* 1秒あたりに補充するトークン数 (0以下なら無制限) */
+    double burst;   /* バケットの容量 */
+    double tokens;
+    struct timeval last;
+    unsigned long passed;   /* 通過した数 */
+    unsigned long dropped;  /* 破棄した数 */
+} token_bucket;
+
+void tb_init(token_bucket *tb, double rate, double burst);
+int tb_take(token_bucket *tb);
+
+// Per-connection send queue for nonblocking sockets. A message sent to many
+// connections is one reference-counted buffer; a flush sends the queue with writev
+#define OUTQ_MAX_BYTES (1024 * 1024) /* これ以上たまった遅いクライアントは切断する */
+#define OUTQ_FLUSH_BYTES (64 * 1024) /* 窓の途中でもこれだけたまったら送る */
+
+typedef struct {
+    int refs;
+    size_t len;
+    char data[];
+} outmsg;
+
+typedef struct {
+    outmsg **msgs;
+    int head, count, cap;
+    size_t offset;  /* 先頭メッセージの送信済みバイト数 */
+    size_t bytes;   /* 未送信のバイト数 */
+    uint64_t since; /* 最も古い未送信メッセージをキューに入れた時刻 (マイクロ秒) */
+    int blocked;    /* ソケットが一杯で送り切れなかった */
+} outq;
+
+outmsg *outmsg_new(const char *msg);                    /* 改行を付けたメッセージ (参照カウント1) */
+outmsg *outmsg_bytes(const void *data, size_t len);     /* data そのままのメッセージ */
+void outmsg_release(outmsg *m);
+int outq_push(outq *q, outmsg *m, uint64_t now);        /* 上限を超えたら-1 */
+int outq_flush(int sock, outq *q);                      /* 送り切れば0、残れば1、エラーなら-1 */
+size_t outq_copy(const outq *q, size_t from, void *buf, size_t size); /* 未送信の from バイト目から写す */
+void outq_clear(outq *q);
+uint64_t outq_now(void);                                /* マイクロ秒 */
+
+// Listening/client socket handoff over a Unix socket (SCM_RIGHTS) for hot upgrades
+#define HANDOFF_TIMEOUT_SEC 5   /* 相手が止まっても入れ替えを待ち続けない */
+#define HANDOFF_CHUNK 16384     /* 送信キューを分けて送るレコードの大きさ */
+
+int handoff_server(const char *path);
+int handoff_connect(const char *path);
+int handoff_send(int sock, int fd, const void *data, size_t len);
+int handoff_recv(int sock, int *fd, void *data, size_t size);
+int handoff_accept(int sock);                           /* 送受信に HANDOFF_TIMEOUT_SEC の期限を付ける */
+int handoff_send_outq(int sock, const outq *q);         /* 未送信のバイトをfdなしのレコードで送る */
+int handoff_recv_outq(int sock, outq *q, size_t bytes); /* q が NULL なら読み捨てる */
+
+// Echo one newline-terminated session without copying through user space
+// (splice through a pipe on Linux, a pipe-sized buffer elsewhere)
+typedef struct {
+    int data[2];    /* ソケットから受けたデータ */
+    int peek[2];    /* 最後の1バイトを見るためのteeの複製先 */
+    int devnull;
+    char *buf;      /* splice がない環境用 */
+    size_t chunk;   /* 1回で運ぶバイト数 (パイプ容量) */
+} echo_pipe;
+
+int echo_pipe_init(echo_pipe *ep);
+void echo_pipe_close(echo_pipe *ep);
+long splice_echo(echo_pipe *ep, int sock);
+
+// CPU affinity and NUMA-local (first-touch) buffers for workers
+int cpu_count(void);
+int pin_cpu(int cpu);
+int incoming_cpu(int sock);
+int set_incoming_cpu(int sock, int cpu);
+void *alloc_local(size_t size);
+void free_local(void *p, size_t size);
+
+// Shared-memory scoreboard where each worker publishes what it is doing
+#define SB_EMPTY 0
+#define SB_IDLE 1       /* accept()で接続を待っている */
+#define SB_BUSY 2       /* セッションを処理している */
+
+typedef struct {
+    _Alignas(64) _Atomic unsigned gen;  /* peerの書き換え中は奇数 */
+    _Atomic int pid;
+    _Atomic int state;
+    _Atomic uint64_t since;     /* 状態が変わった時刻 (ミリ秒) */
+    _Atomic uint64_t requests;  /* 処理を終えたセッション数 */
+    _Atomic uint64_t bytes;     /* 送り返したバイト数 */
+    char peer[40];              /* 処理中の接続の相手 */
+} sb_slot;
+
+typedef struct {
+    uint32_t magic;
+    int32_t n_slots;
+    uint64_t started;           /* 作成した時刻 (ミリ秒) */
+    sb_slot slot[];
+} sb_board;
+
+sb_board *sb_create(const char *path, int n_slots);
+sb_board *sb_attach(const char *path);
+void sb_start(sb_slot *s, int pid);
+void sb_begin(sb_slot *s, int sock);
+void sb_add(sb_slot *s, uint64_t bytes);
+void sb_end(sb_slot *s);
+void sb_exit(sb_slot *s);
+void sb_read(sb_slot *s, sb_slot *copy);
+const char *sb_state_name(int state);
+uint64_t sb_now(void);
+
 #endif  /* MYNET_H_ */
@@ -0,0 +1,175 @@
+/*
+  outq.c
+  接続ごとの送信キュー (ノンブロッキングのソケットに送り切れなかった分を溜める)
+*/
+
+#include "mynet.h"
+#include <errno.h>
+#include <limits.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 64
+#endif
+#define OUTQ_IOV (IOV_MAX < 256 ? IOV_MAX : 256)
+
+uint64_t outq_now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+outmsg *outmsg_bytes(const void *data, size_t len)
+{
+  outmsg *m;
+
+  if( (m = malloc(sizeof(outmsg) + len)) == NULL ){
+    exit_errmesg("malloc()");
+  }
+  m->refs = 1;
+  m->len = len;
+  memcpy(m->data, data, len);
+  return(m);
+}
+
+outmsg *outmsg_new(const char *msg)
+{
+  size_t len = strlen(msg);
+  outmsg *m = outmsg_bytes(msg, len + 1);
+
+  m->data[len] = '\n';
+  return(m);
+}
+
+void outmsg_release(outmsg *m)
+{
+  if( --m->refs == 0 ){
+    free(m);
+  }
+}
+
+int outq_push(outq *q, outmsg *m, uint64_t now)
+{
+  if( q->bytes + m->len > OUTQ_MAX_BYTES ){
+    return(-1);
+  }
+  if( q->count == q->cap ){
+    /* リングを広げるときは先頭から順に並べ直す */
+    int cap = q->cap ? q->cap * 2 : 16;
+    outmsg **msgs;
+    if( (msgs = malloc(cap * sizeof(outmsg *))) == NULL ){
+      exit_errmesg("malloc()");
+    }
+    for( int i = 0; i < q->count; i++ ){
+      msgs[i] = q->msgs[(q->head + i) % q->cap];
+    }
+    free(q->msgs);
+    q->msgs = msgs;
+    q->cap = cap;
+    q->head = 0;
+  }
+  if( q->count == 0 ){
+    q->since = now;
+  }
+  m->refs++;
+  q->msgs[(q->head + q->count) % q->cap] = m;
+  q->count++;
+  q->bytes += m->len;
+  return(0);
+}
+
+static void set_cork(int sock, int on)
+{
+#if defined(TCP_CORK)
+  setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#elif defined(TCP_NOPUSH)
+  setsockopt(sock, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on));
+#else
+  (void)sock;
+  (void)on;
+#endif
+}
+
+/* 送信済みの n バイト分だけキューを進める */
+static void consume(outq *q, size_t n)
+{
+  q->bytes -= n;
+  while( n > 0 ){
+    outmsg *m = q->msgs[q->head];
+    size_t rest = m->len - q->offset;
+    if( n < rest ){
+      q->offset += n;
+      return;
+    }
+    n -= rest;
+    q->offset = 0;
+    outmsg_release(m);
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+  }
+}
+
+int outq_flush(int sock, outq *q)
+{
+  struct iovec iov[OUTQ_IOV];
+  int result = 0;
+
+  if( q->count == 0 ){
+    q->blocked = 0;
+    return(0);
+  }
+
+  /* 複数回のwritevに分かれても、途中で小さなセグメントを送らないようにする */
+  set_cork(sock, 1);
+  while( q->count > 0 ){
+    int n = q->count < OUTQ_IOV ? q->count : OUTQ_IOV;
+    for( int i = 0; i < n; i++ ){
+      outmsg *m = q->msgs[(q->head + i) % q->cap];
+      size_t skip = i == 0 ? q->offset : 0;
+      iov[i].iov_base = m->data + skip;
+      iov[i].iov_len = m->len - skip;
+    }
+
+    ssize_t r = writev(sock, iov, n);
+    if( r == -1 ){
+      if( errno == EINTR ) continue;
+      result = (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+      break;
+    }
+    consume(q, r);
+  }
+  set_cork(sock, 0);
+  q->blocked = result == 1;
+  return(result);
+}
+
+size_t outq_copy(const outq *q, size_t from, void *buf, size_t size)
+{
+  size_t skip = q->offset + from, done = 0;
+
+  for( int i = 0; i < q->count && done < size; i++ ){
+    outmsg *m = q->msgs[(q->head + i) % q->cap];
+    if( skip >= m->len ){
+      skip -= m->len;
+      continue;
+    }
+    size_t n = m->len - skip < size - done ? m->len - skip : size - done;
+    memcpy((char *)buf + done, m->data + skip, n);
+    done += n;
+    skip = 0;
+  }
+  return(done);
+}
+
+void outq_clear(outq *q)
+{
+  while( q->count > 0 ){
+    outmsg_release(q->msgs[q->head]);
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+  }
+  free(q->msgs);
+  memset(q, 0, sizeof(*q));
+}
@@ -0,0 +1,48 @@
+/*
+  ratelimit.c
+  トークンバケットによる流量制限
+*/
+
+#include "mynet.h"
+
+static double elapsed_sec(struct timeval *from, struct timeval *to)
+{
+  return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+void tb_init(token_bucket *tb, double rate, double burst)
+{
+  tb->rate = rate;
+  tb->burst = burst > 0 ? burst : 1;
+  tb->tokens = tb->burst; /* 最初はバースト分だけ送れる */
+  tb->passed = 0;
+  tb->dropped = 0;
+  gettimeofday(&tb->last, NULL);
+}
+
+int tb_take(token_bucket *tb)
+{
+  struct timeval now;
+
+  /* rateが0以下なら制限しない */
+  if( tb->rate <= 0 ){
+    tb->passed++;
+    return(1);
+  }
+
+  /* 前回からの経過時間に応じてトークンを補充する */
+  gettimeofday(&now, NULL);
+  tb->tokens += elapsed_sec(&tb->last, &now) * tb->rate;
+  if( tb->tokens > tb->burst ){
+    tb->tokens = tb->burst;
+  }
+  tb->last = now;
+
+  if( tb->tokens < 1.0 ){
+    tb->dropped++;
+    return(0);
+  }
+  tb->tokens -= 1.0;
+  tb->passed++;
+  return(1);
+}
@@ -0,0 +1,179 @@
+/*
+  scoreboard.c
+  ワーカーの状態を共有メモリで公開するスコアボード
+  各スロットに書き込むのは担当のワーカー1つだけなので、カウンタはロックなしで更新する。
+  接続相手の文字列は世代番号 (seqlock) で守り、ビューアは書き換え中なら読み直す。
+*/
+
+#include "mynet.h"
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SB_MAGIC 0x53423031 /* "SB01" */
+
+static size_t board_size(int n_slots)
+{
+  return(sizeof(sb_board) + n_slots * sizeof(sb_slot));
+}
+
+uint64_t sb_now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return((uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+sb_board *sb_create(const char *path, int n_slots)
+{
+  sb_board *board;
+  size_t size = board_size(n_slots);
+  char tmp[1024];
+  int fd = -1;
+
+  /* パスがなければ、forkした子にだけ見える無名の共有メモリにする。
+     パスがあっても、入れ替え前のワーカーがまだ同じパスのファイルを
+     マップしているかもしれないので、別のファイルに作ってから置き換える */
+  if( path != NULL ){
+    if( snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >= (int)sizeof(tmp) ){
+      return(NULL);
+    }
+    unlink(tmp);
+    if( (fd = open(tmp, O_RDWR | O_CREAT | O_EXCL, 0644)) == -1 ){
+      return(NULL);
+    }
+    if( ftruncate(fd, size) == -1 ){
+      close(fd);
+      unlink(tmp);
+      return(NULL);
+    }
+  }
+  board = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               path != NULL ? MAP_SHARED : MAP_SHARED | MAP_ANONYMOUS, fd, 0);
+  if( fd != -1 ){
+    close(fd);
+  }
+  if( board == MAP_FAILED ){
+    if( path != NULL ) unlink(tmp);
+    return(NULL);
+  }
+
+  memset(board, 0, size);
+  board->n_slots = n_slots;
+  board->started = sb_now();
+  board->magic = SB_MAGIC;
+
+  /* 書き終えてから差し替えるので、ビューアが空のボードを見ることもない */
+  if( path != NULL && rename(tmp, path) == -1 ){
+    munmap(board, size);
+    unlink(tmp);
+    return(NULL);
+  }
+  return(board);
+}
+
+sb_board *sb_attach(const char *path)
+{
+  sb_board *board;
+  struct stat st;
+  int fd;
+
+  if( (fd = open(path, O_RDONLY)) == -1 ){
+    return(NULL);
+  }
+  if( fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(sb_board) ){
+    close(fd);
+    return(NULL);
+  }
+  /* ビューアは読むだけなので、ワーカーの邪魔にならない */
+  board = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if( board == MAP_FAILED ){
+    return(NULL);
+  }
+  if( board->magic != SB_MAGIC || (size_t)st.st_size < board_size(board->n_slots) ){
+    munmap(board, st.st_size);
+    return(NULL);
+  }
+  return(board);
+}
+
+/* 書き手は1つだけなので、読み出して足した値をそのまま書けばよい (ロック命令は不要) */
+static void add_relaxed(_Atomic uint64_t *counter, uint64_t n)
+{
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                        memory_order_relaxed);
+}
+
+static void set_state(sb_slot *s, int state)
+{
+  atomic_store_explicit(&s->since, sb_now(), memory_order_relaxed);
+  atomic_store_explicit(&s->state, state, memory_order_release);
+}
+
+void sb_start(sb_slot *s, int pid)
+{
+  atomic_store_explicit(&s->pid, pid, memory_order_relaxed);
+  set_state(s, SB_IDLE);
+}
+
+void sb_begin(sb_slot *s, int sock)
+{
+  struct sockaddr_in adrs;
+  socklen_t len = sizeof(adrs);
+  unsigned gen = atomic_load_explicit(&s->gen, memory_order_relaxed);
+
+  /* 奇数のあいだは書き換え中 */
+  atomic_store_explicit(&s->gen, gen + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  if( getpeername(sock, (struct sockaddr *)&adrs, &len) == 0 && adrs.sin_family == AF_INET ){
+    snprintf(s->peer, sizeof(s->peer), "%s:%u", inet_ntoa(adrs.sin_addr), ntohs(adrs.sin_port));
+  }
+  else{
+    snprintf(s->peer, sizeof(s->peer), "fd %d", sock);
+  }
+  atomic_store_explicit(&s->gen, gen + 2, memory_order_release);
+
+  set_state(s, SB_BUSY);
+}
+
+void sb_add(sb_slot *s, uint64_t bytes)
+{
+  add_relaxed(&s->bytes, bytes);
+}
+
+void sb_end(sb_slot *s)
+{
+  add_relaxed(&s->requests, 1);
+  set_state(s, SB_IDLE);
+}
+
+void sb_exit(sb_slot *s)
+{
+  set_state(s, SB_EMPTY);
+}
+
+void sb_read(sb_slot *s, sb_slot *copy)
+{
+  unsigned gen;
+
+  do{
+    while( (gen = atomic_load_explicit(&s->gen, memory_order_acquire)) & 1 );
+    memcpy(copy, s, sizeof(*copy));
+    atomic_thread_fence(memory_order_acquire);
+  }while( atomic_load_explicit(&s->gen, memory_order_relaxed) != gen );
+}
+
+const char *sb_state_name(int state)
+{
+  switch( state ){
+  case SB_IDLE:
+    return("idle");
+  case SB_BUSY:
+    return("busy");
+  default:
+    return("-");
+  }
+}
@@ -0,0 +1,171 @@
+/*
+  splice_echo.c
+  カーネル内でのエコー (socket → pipe → 同じsocket)
+  受信したデータはユーザ空間にコピーせず、パイプを経由してそのまま送り返す。
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "mynet.h"
+#include <errno.h>
+#include <fcntl.h>
+
+#define ECHO_PIPE_SIZE (1024 * 1024) /* パイプ容量の希望値 (pipe-max-sizeまで) */
+
+#ifdef __linux__
+
+static int open_pipes(echo_pipe *ep)
+{
+  int size;
+
+  if( pipe(ep->data) == -1 ){
+    return(-1);
+  }
+  if( pipe(ep->peek) == -1 ){
+    close(ep->data[0]);
+    close(ep->data[1]);
+    return(-1);
+  }
+
+  /* 1回のspliceで運ぶ量はパイプ容量で決まるので、できるだけ大きくする */
+  fcntl(ep->data[1], F_SETPIPE_SZ, ECHO_PIPE_SIZE);
+  fcntl(ep->peek[1], F_SETPIPE_SZ, ECHO_PIPE_SIZE);
+  if( (size = fcntl(ep->data[1], F_GETPIPE_SZ)) > fcntl(ep->peek[1], F_GETPIPE_SZ) ){
+    size = fcntl(ep->peek[1], F_GETPIPE_SZ);
+  }
+  ep->chunk = size > 0 ? size : 65536;
+  return(0);
+}
+
+static void close_pipes(echo_pipe *ep)
+{
+  close(ep->data[0]);
+  close(ep->data[1]);
+  close(ep->peek[0]);
+  close(ep->peek[1]);
+}
+
+int echo_pipe_init(echo_pipe *ep)
+{
+  if( (ep->devnull = open("/dev/null", O_WRONLY)) == -1 ){
+    return(-1);
+  }
+  if( open_pipes(ep) == -1 ){
+    close(ep->devnull);
+    return(-1);
+  }
+  return(0);
+}
+
+void echo_pipe_close(echo_pipe *ep)
+{
+  close_pipes(ep);
+  close(ep->devnull);
+}
+
+/* シグナルで中断されても、運んだ分をなくさないように続ける */
+static ssize_t splice_all(int from, int to, size_t len)
+{
+  ssize_t r;
+  size_t done = 0;
+
+  while( done < len ){
+    if( (r = splice(from, NULL, to, NULL, len - done, SPLICE_F_MOVE)) == -1 ){
+      if( errno == EINTR ) continue;
+      return(-1);
+    }
+    if( r == 0 ) break;
+    done += r;
+  }
+  return(done);
+}
+
+/* パイプに入っている len バイトの最後の1バイトを返す。
+   teeは参照を複製するだけなので、読み捨てる部分もコピーされない */
+static int last_byte(echo_pipe *ep, size_t len)
+{
+  unsigned char c;
+  ssize_t r;
+
+  while( (r = tee(ep->data[0], ep->peek[1], len, 0)) == -1 && errno == EINTR );
+  if( r != (ssize_t)len ){
+    return(-1);
+  }
+  if( len > 1 && splice_all(ep->peek[0], ep->devnull, len - 1) != (ssize_t)(len - 1) ){
+    return(-1);
+  }
+  while( (r = read(ep->peek[0], &c, 1)) == -1 && errno == EINTR );
+  return(r == 1 ? c : -1);
+}
+
+long splice_echo(echo_pipe *ep, int sock)
+{
+  long total = 0;
+  ssize_t n;
+  int last;
+
+  do{
+    /* ソケットから、パイプに入るだけ受け取る */
+    while( (n = splice(sock, NULL, ep->data[1], NULL, ep->chunk, SPLICE_F_MOVE)) == -1 && errno == EINTR );
+    if( n <= 0 ){
+      return(n == 0 ? total : -1);
+    }
+
+    /* 送り返す前に、改行で終わっているかを見ておく */
+    if( (last = last_byte(ep, n)) == -1 || splice_all(ep->data[0], sock, n) != n ){
+      /* パイプに残ったデータを次のセッションに持ち越さないよう作り直す */
+      close_pipes(ep);
+      if( open_pipes(ep) == -1 ){
+        exit_errmesg("pipe()");
+      }
+      return(-1);
+    }
+    total += n;
+  }while( last != '\n' ); /* 改行コードを受信するまで繰り返す */
+
+  return(total);
+}
+
+#else /* spliceのない環境では、パイプ容量と同じ大きさのバッファでコピーする */
+
+int echo_pipe_init(echo_pipe *ep)
+{
+  ep->chunk = 65536;
+  if( (ep->buf = malloc(ep->chunk)) == NULL ){
+    return(-1);
+  }
+  return(0);
+}
+
+void echo_pipe_close(echo_pipe *ep)
+{
+  free(ep->buf);
+}
+
+long splice_echo(echo_pipe *ep, int sock)
+{
+  long total = 0;
+  ssize_t n, r, off;
+
+  do{
+    while( (n = recv(sock, ep->buf, ep->chunk, 0)) == -1 && errno == EINTR );
+    if( n <= 0 ){
+      return(n == 0 ? total : -1);
+    }
+    for( off = 0; off < n; off += r ){
+      if( (r = send(sock, ep->buf + off, n - off, 0)) == -1 ){
+        if( errno == EINTR ){
+          r = 0;
+          continue;
+        }
+        return(-1);
+      }
+    }
+    total += n;
+  }while( ep->buf[n - 1] != '\n' );
+
+  return(total);
+}
+
+#endif
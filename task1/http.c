@@ -0,0 +1,283 @@
+/*
+  http.c
+*/
+
+#include "http.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define S_STATUS 0          /* waiting for the status line */
+#define S_HEADER 1          /* header lines up to the empty one */
+#define S_BODY_LENGTH 2     /* Content-Length bytes of body */
+#define S_BODY_EOF 3        /* body up to the end of the connection */
+#define S_CHUNK_SIZE 4      /* chunk-size line */
+#define S_CHUNK_DATA 5      /* chunk data */
+#define S_CHUNK_END 6       /* CRLF after the chunk data */
+#define S_TRAILER 7         /* trailer lines after the last chunk */
+#define S_END 8             /* report HTTP_END next */
+#define S_ERROR 9
+
+void http_parser_init(struct http_parser *p, int head)
+{
+    memset(p, 0, offsetof(struct http_parser, line));
+    p->line_len = 0;
+    p->state = S_STATUS;
+    p->head = head;
+    p->content_length = -1;
+}
+
+static size_t fail(struct http_parser *p, const char *why, size_t used, struct http_event *ev)
+{
+    p->state = S_ERROR;
+    p->error = why;
+    ev->type = HTTP_ERROR;
+    return used;
+}
+
+/* Take the next line. Returns 1 with the line and its length (without the CR LF)
+   and *used advanced past it, or 0 when the line is not complete yet (the
+   part seen is kept) or is too long (*used is set to -1). */
+static int get_line(struct http_parser *p, const char *data, size_t len, size_t *used,
+                    const char **line, size_t *line_len)
+{
+    const char *start = data + *used;
+    size_t avail = len - *used;
+    const char *nl = memchr(start, '\n', avail);
+    size_t n = nl ? (size_t)(nl - start) : avail;
+
+    if (p->line_len == 0 && nl != NULL) {
+        *line = start; /* whole in the input: no copy */
+        *line_len = n;
+    } else {
+        if (p->line_len + n >= sizeof(p->line)) {
+            *used = (size_t)-1;
+            return 0;
+        }
+        memcpy(p->line + p->line_len, start, n);
+        p->line_len += n;
+        p->line[p->line_len] = '\0'; /* numbers are read with strtoll() */
+        if (nl == NULL) {
+            *used = len;
+            return 0;
+        }
+        *line = p->line;
+        *line_len = p->line_len;
+        p->line_len = 0; /* the text stays until the next call */
+    }
+    *used += n + 1;
+    if (*line_len > 0 && (*line)[*line_len - 1] == '\r') {
+        (*line_len)--;
+    }
+    return 1;
+}
+
+/* Whether the comma-separated list in value holds token */
+static int has_token(const char *value, size_t len, const char *token)
+{
+    size_t tlen = strlen(token), i = 0;
+
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && value[i] != ',' && value[i] != ';' && value[i] != ' ' && value[i] != '\t') {
+            i++;
+        }
+        if (i - start == tlen && strncasecmp(value + start, token, tlen) == 0) {
+            return 1;
+        }
+        while (i < len && value[i] != ',') {
+            i++;
+        }
+    }
+    return 0;
+}
+
+static int parse_status(struct http_parser *p, const char *line, size_t n, struct http_event *ev)
+{
+    size_t i = 9;
+
+    if (n < 12 || strncmp(line, "HTTP/1.", 7) != 0 || line[7] < '0' || line[7] > '9' || line[8] != ' ' ||
+        line[9] < '1' || line[9] > '9' || line[10] < '0' || line[10] > '9' || line[11] < '0' || line[11] > '9') {
+        return 0;
+    }
+    p->minor = line[7] - '0';
+    p->status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+    p->keep_alive = p->minor >= 1;
+    p->chunked = 0;
+    p->content_length = -1;
+    p->body_bytes = 0;
+    i = 12 + (n > 12 && line[12] == ' ');
+    ev->type = HTTP_STATUS;
+    ev->value = line + i;
+    ev->value_len = n - i;
+    return 1;
+}
+
+static int parse_header(struct http_parser *p, const char *line, size_t n, struct http_event *ev)
+{
+    const char *colon = memchr(line, ':', n);
+    const char *value, *end = line + n;
+    char *stop;
+
+    if (colon == NULL || colon == line) {
+        return 0;
+    }
+    for (value = colon + 1; value < end && (*value == ' ' || *value == '\t'); value++)
+        ;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    ev->type = HTTP_HEADER;
+    ev->name = line;
+    ev->name_len = colon - line;
+    ev->value = value;
+    ev->value_len = end - value;
+
+    if (ev->name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+        if (value == end || *value < '0' || *value > '9' ||
+            (p->content_length = strtoll(value, &stop, 10)) < 0 || stop != end) {
+            return 0;
+        }
+    } else if (ev->name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+        p->chunked = has_token(value, end - value, "chunked");
+    } else if (ev->name_len == 10 && strncasecmp(line, "Connection", 10) == 0) {
+        if (has_token(value, end - value, "close")) {
+            p->keep_alive = 0;
+        } else if (has_token(value, end - value, "keep-alive")) {
+            p->keep_alive = 1;
+        }
+    }
+    return 1;
+}
+
+/* After the empty line: work out how the body is delimited */
+static void headers_end(struct http_parser *p, struct http_event *ev)
+{
+    ev->type = HTTP_HEADERS_END;
+    if (p->head || p->status < 200 || p->status == 204 || p->status == 304) {
+        p->state = S_END;
+    } else if (p->chunked) {
+        p->state = S_CHUNK_SIZE;
+    } else if (p->content_length >= 0) {
+        p->remaining = p->content_length;
+        p->state = p->remaining > 0 ? S_BODY_LENGTH : S_END;
+    } else {
+        p->state = S_BODY_EOF;
+        p->keep_alive = 0; /* only the close tells where the body ends */
+    }
+}
+
+size_t http_parse(struct http_parser *p, const char *data, size_t len, struct http_event *ev)
+{
+    size_t used = 0, n;
+    const char *line;
+    char *stop;
+
+    ev->type = HTTP_NONE;
+    for (;;) {
+        switch (p->state) {
+        case S_STATUS:
+        case S_HEADER:
+        case S_CHUNK_SIZE:
+        case S_CHUNK_END:
+        case S_TRAILER:
+            if (used == len || !get_line(p, data, len, &used, &line, &n)) {
+                if (used == (size_t)-1) {
+                    return fail(p, "line too long", len, ev);
+                }
+                return used;
+            }
+            if (p->state == S_STATUS) {
+                if (n == 0) {
+                    continue; /* tolerate blank lines between responses */
+                }
+                if (!parse_status(p, line, n, ev)) {
+                    return fail(p, "bad status line", used, ev);
+                }
+                p->state = S_HEADER;
+                return used;
+            }
+            if (p->state == S_HEADER) {
+                if (n > 0) {
+                    if (!parse_header(p, line, n, ev)) {
+                        return fail(p, "bad header line", used, ev);
+                    }
+                    return used;
+                }
+                if (p->status >= 100 && p->status < 200 && p->status != 101) {
+                    p->state = S_STATUS; /* an interim response: the real one follows */
+                    continue;
+                }
+                headers_end(p, ev);
+                return used;
+            }
+            if (p->state == S_CHUNK_SIZE) {
+                if (n == 0 || (p->remaining = strtoll(line, &stop, 16)) < 0 ||
+                    stop == line || (stop != line + n && *stop != ';' && *stop != ' ' && *stop != '\t')) {
+                    return fail(p, "bad chunk size", used, ev);
+                }
+                p->state = p->remaining > 0 ? S_CHUNK_DATA : S_TRAILER;
+                continue;
+            }
+            if (p->state == S_CHUNK_END) {
+                if (n != 0) {
+                    return fail(p, "chunk not followed by CRLF", used, ev);
+                }
+                p->state = S_CHUNK_SIZE;
+                continue;
+            }
+            if (n == 0) {
+                p->state = S_END; /* the end of the trailer */
+            }
+            continue;
+
+        case S_BODY_LENGTH:
+        case S_CHUNK_DATA:
+        case S_BODY_EOF:
+            if (used == len) {
+                return used;
+            }
+            // Body data is passed on in place
+            n = len - used;
+            if (p->state != S_BODY_EOF && (long long)n > p->remaining) {
+                n = p->remaining;
+            }
+            ev->type = HTTP_BODY;
+            ev->data = data + used;
+            ev->len = n;
+            p->body_bytes += n;
+            if (p->state != S_BODY_EOF && (p->remaining -= n) == 0) {
+                p->state = p->state == S_CHUNK_DATA ? S_CHUNK_END : S_END;
+            }
+            return used + n;
+
+        case S_END:
+            ev->type = HTTP_END;
+            p->state = S_STATUS;
+            p->head = 0;
+            return used;
+
+        default:
+            ev->type = HTTP_ERROR;
+            return used;
+        }
+    }
+}
+
+int http_parse_eof(struct http_parser *p)
+{
+    if (p->state == S_BODY_EOF) {
+        p->state = S_STATUS;
+        return HTTP_END;
+    }
+    if (p->state == S_STATUS && p->line_len == 0) {
+        return HTTP_NONE;
+    }
+    p->error = "connection closed in the middle of the response";
+    p->state = S_ERROR;
+    return HTTP_ERROR;
+}
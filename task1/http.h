@@ -0,0 +1,65 @@
+#ifndef HTTP_H_
+#define HTTP_H_
+/*
+  http.h
+  Incremental HTTP/1.1 response parser.
+  Feed it whatever recv() returned, in pieces of any size; it hands back one
+  event at a time. Header names and values, and body data, point into the
+  bytes passed in whenever they lie there whole (no copy); only a header
+  line split between two pieces is gathered in the parser, so the memory
+  used is fixed whatever the size of the response. Content-Length, chunked
+  transfer coding, bodies that end with the connection, and responses that
+  have no body (HEAD, 1xx, 204, 304) are all handled, and the parser says
+  whether the connection can carry the next request.
+*/
+#include <stddef.h>
+
+#define HTTP_MAX_LINE 8192  /* longest status, header or chunk-size line */
+
+/* Events returned by http_parse() */
+#define HTTP_NONE 0         /* all the input was used; give it more */
+#define HTTP_STATUS 1       /* status line: status, value = reason phrase */
+#define HTTP_HEADER 2       /* name, value */
+#define HTTP_HEADERS_END 3  /* the body (if any) follows */
+#define HTTP_BODY 4         /* data, len: a piece of the (de-chunked) body */
+#define HTTP_END 5          /* the response is complete */
+#define HTTP_ERROR 6        /* malformed response; error says why */
+
+struct http_event {
+    int type;
+    const char *name, *value;
+    size_t name_len, value_len;
+    const char *data;
+    size_t len;
+};
+
+struct http_parser {
+    int state;
+    int head;               /* the request was HEAD: no body whatever the headers say */
+    int status;             /* status code of the response */
+    int minor;              /* HTTP/1.<minor> */
+    int chunked;
+    int keep_alive;         /* the connection may be used again after HTTP_END */
+    long long content_length;   /* -1 when not given */
+    long long remaining;    /* body bytes left (of the length, or of the chunk) */
+    long long body_bytes;   /* body bytes delivered so far */
+    const char *error;
+    char line[HTTP_MAX_LINE];   /* a line split between two pieces of input */
+    size_t line_len;
+};
+
+/* Get ready for the response to one request (head: it was a HEAD) */
+void http_parser_init(struct http_parser *p, int head);
+
+/* Parse from data[0..len). Returns how many bytes were used and sets *ev.
+   Call again with the rest until the event is HTTP_NONE; its pointers are
+   valid until the next call. After HTTP_END the parser is ready for the
+   next response on the same connection (set p->head if needed). */
+size_t http_parse(struct http_parser *p, const char *data, size_t len, struct http_event *ev);
+
+/* The connection was closed. Returns HTTP_END when that completes the
+   response (a body delimited by the close), HTTP_NONE when no response
+   was under way, and HTTP_ERROR otherwise. */
+int http_parse_eof(struct http_parser *p);
+
+#endif /* HTTP_H_ */
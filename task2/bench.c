@@ -0,0 +1,244 @@
+/*
+
+    --- コンパイルコマンド ---
+    gcc -I../mynet -L../mynet -o bench bench.c -lmynet
+    または、makefileを使用して make コマンドによるコンパイル
+
+    --- 実行例 ---
+
+    ./task2 50000 &
+    ./bench -c 1000 -d 5 localhost 50000
+
+    Load generator for the task2 file server. It opens <clients> sessions at
+    the same time, logs each one in with the password and then keeps sending
+    <command> (default "list"), waiting for the next "> " prompt before
+    sending it again. A request is one command; its latency is measured from
+    sending the command to receiving the whole reply including the prompt.
+
+*/
+
+#include "mynet.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+
+#define DEFAULT_CLIENTS 10
+#define DEFAULT_SECONDS 5
+#define DEFAULT_COMMAND "list"
+#define PASSWORD "password"
+#define RECVSIZE 65536
+
+#define CLIENT_PASSWORD 0   /* waiting for "password: " */
+#define CLIENT_LOGIN 1      /* password sent, waiting for the first prompt */
+#define CLIENT_REPLY 2      /* command sent, waiting for the prompt after its output */
+
+struct client {
+    int sock;
+    int state;
+    char tail[16];      /* last bytes received, to spot the prompt */
+    int tail_len;
+    const char *out;    /* what to send next */
+    int out_len, sent;
+    double start;       /* when the current command was sent */
+};
+
+static struct sockaddr_in server_adrs;
+static char command[256];
+static char password_line[] = PASSWORD "\n";
+
+static double *latency;     /* per-request latency in seconds */
+static long n_latency, latency_cap;
+static long n_errors;
+
+static double now_sec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void record_latency(double sec) {
+    if (n_latency == latency_cap) {
+        latency_cap = latency_cap ? latency_cap * 2 : 4096;
+        if ((latency = realloc(latency, latency_cap * sizeof(double))) == NULL) {
+            exit_errmesg("realloc()");
+        }
+    }
+    latency[n_latency++] = sec;
+}
+
+static void start_client(struct client *c) {
+    if ((c->sock = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+        exit_errmesg("socket()");
+    }
+    fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL, 0) | O_NONBLOCK);
+    c->state = CLIENT_PASSWORD;
+    c->tail_len = 0;
+    c->out = NULL;
+    c->out_len = c->sent = 0;
+    if (connect(c->sock, (struct sockaddr *)&server_adrs, sizeof(server_adrs)) == -1 &&
+        errno != EINPROGRESS) {
+        perror("connect()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void send_line(struct client *c, const char *line) {
+    c->out = line;
+    c->out_len = strlen(line);
+    c->sent = 0;
+}
+
+static int ends_with(struct client *c, const char *s) {
+    int len = strlen(s);
+    return c->tail_len >= len && memcmp(c->tail + c->tail_len - len, s, len) == 0;
+}
+
+/* Keep only the last few bytes of what arrived */
+static void remember(struct client *c, const char *buf, int len) {
+    int keep = sizeof(c->tail);
+
+    if (len >= keep) {
+        memcpy(c->tail, buf + len - keep, keep);
+        c->tail_len = keep;
+        return;
+    }
+    if (c->tail_len + len > keep) {
+        int drop = c->tail_len + len - keep;
+        memmove(c->tail, c->tail + drop, c->tail_len - drop);
+        c->tail_len -= drop;
+    }
+    memcpy(c->tail + c->tail_len, buf, len);
+    c->tail_len += len;
+}
+
+/* Move one client forward. Returns 0 when its connection failed. */
+static int step(struct client *c, short revents) {
+    static char buf[RECVSIZE];
+    int r;
+
+    if (revents & (POLLERR | POLLNVAL)) {
+        return 0;
+    }
+    if ((revents & POLLOUT) && c->sent < c->out_len) {
+        r = send(c->sock, c->out + c->sent, c->out_len - c->sent, 0);
+        if (r == -1) {
+            return errno == EAGAIN || errno == EINPROGRESS;
+        }
+        c->sent += r;
+    }
+    if (revents & (POLLIN | POLLHUP)) {
+        r = recv(c->sock, buf, sizeof(buf), 0);
+        if (r == -1 && errno == EAGAIN) {
+            return 1;
+        }
+        if (r <= 0) {
+            return 0;
+        }
+        remember(c, buf, r);
+        if (c->state == CLIENT_PASSWORD && ends_with(c, "password: ")) {
+            send_line(c, password_line);
+            c->state = CLIENT_LOGIN;
+        } else if (c->state != CLIENT_PASSWORD && ends_with(c, "> ")) {
+            if (c->state == CLIENT_REPLY) {
+                record_latency(now_sec() - c->start);
+            }
+            c->tail_len = 0;
+            send_line(c, command);
+            c->start = now_sec();
+            c->state = CLIENT_REPLY;
+        }
+    }
+    return 1;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double p) {
+    long i = (long)(p * (n_latency - 1));
+    return n_latency ? latency[i] * 1000 : 0;
+}
+
+static void print_usage(char *program_name) {
+    fprintf(stderr, "Usage: %s [-c clients] [-d seconds] [-m command] <server> <port_number>\n", program_name);
+}
+
+int main(int argc, char *argv[]) {
+    int n_clients = DEFAULT_CLIENTS;
+    double seconds = DEFAULT_SECONDS;
+    struct client *clients;
+    struct pollfd *pfd;
+    struct rlimit rl;
+    int c, i;
+
+    snprintf(command, sizeof(command), "%s\n", DEFAULT_COMMAND);
+    while ((c = getopt(argc, argv, "c:d:m:h")) != -1) {
+        switch (c) {
+        case 'c':
+            n_clients = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        case 'm':
+            snprintf(command, sizeof(command), "%s\n", optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 2 || n_clients <= 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    set_sockaddr_in(&server_adrs, argv[optind], atoi(argv[optind + 1]));
+
+    // Thousands of concurrent sessions need as many descriptors
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if ((clients = malloc(n_clients * sizeof(struct client))) == NULL ||
+        (pfd = malloc(n_clients * sizeof(struct pollfd))) == NULL) {
+        exit_errmesg("malloc()");
+    }
+    for (i = 0; i < n_clients; i++) {
+        start_client(&clients[i]);
+    }
+
+    double begin = now_sec(), end = begin + seconds;
+    while (now_sec() < end) {
+        for (i = 0; i < n_clients; i++) {
+            pfd[i].fd = clients[i].sock;
+            pfd[i].events = POLLIN | (clients[i].sent < clients[i].out_len ? POLLOUT : 0);
+        }
+        if (poll(pfd, n_clients, 100) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            exit_errmesg("poll()");
+        }
+        for (i = 0; i < n_clients; i++) {
+            if (pfd[i].revents && !step(&clients[i], pfd[i].revents)) {
+                // Count the failure and log in again
+                n_errors++;
+                close(clients[i].sock);
+                start_client(&clients[i]);
+            }
+        }
+    }
+    double elapsed = now_sec() - begin;
+
+    qsort(latency, n_latency, sizeof(double), compare_double);
+    printf("sessions %d, %.1f sec: %ld requests (%.0f requests/sec), %ld errors\n",
+           n_clients, elapsed, n_latency, n_latency / elapsed, n_errors);
+    printf("latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           percentile(0.50), percentile(0.99), percentile(1.0));
+
+    return 0;
+}
@@ -0,0 +1,320 @@
+/*
+  checksum.c
+*/
+
+#include "checksum.h"
+#include "files.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SSE2 1
+#define HAVE_AVX2 1         /* compiled with a target attribute, chosen at run time */
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#define STRIPE 64           /* bytes per accumulate step: 8 lanes x 8 bytes */
+#define BLOCK_STRIPES 16    /* stripes between scrambles of the accumulators */
+#define CACHE_SIZE 4096     /* remembered file sums (a power of two) */
+#define READ_SIZE (256 * 1024) /* bytes read at a time by checksum_file() (whole blocks) */
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+/* Per-lane keys: mixed into every stripe, and into the final merge */
+static const uint64_t Key[8] __attribute__((aligned(64))) = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+typedef void (*accumulate_fn)(uint64_t *acc, const unsigned char *p, size_t stripes);
+
+/*
+  The kernel. For every stripe and lane i (8 bytes d, k = d ^ Key[i]):
+    acc[i ^ 1] += d
+    acc[i]     += (k & 0xffffffff) * (k >> 32)
+  Adding d to the neighbour lane keeps every input bit in the sum even when
+  the multiply loses it.
+*/
+static void accumulate_scalar(uint64_t *acc, const unsigned char *p, size_t stripes) {
+    uint64_t d, k;
+    size_t s;
+    int i;
+
+    for (s = 0; s < stripes; s++, p += STRIPE) {
+        for (i = 0; i < 8; i++) {
+            memcpy(&d, p + 8 * i, 8); /* little-endian hosts only */
+            k = d ^ Key[i];
+            acc[i ^ 1] += d;
+            acc[i] += (k & 0xffffffff) * (k >> 32);
+        }
+    }
+}
+
+#ifdef HAVE_SSE2
+static void accumulate_sse2(uint64_t *acc, const unsigned char *p, size_t stripes) {
+    __m128i a[4], key[4];
+    size_t s;
+    int j;
+
+    for (j = 0; j < 4; j++) {
+        a[j] = _mm_loadu_si128((const __m128i *)acc + j);
+        key[j] = _mm_load_si128((const __m128i *)Key + j);
+    }
+    for (s = 0; s < stripes; s++, p += STRIPE) {
+        for (j = 0; j < 4; j++) {
+            __m128i d = _mm_loadu_si128((const __m128i *)p + j);
+            __m128i k = _mm_xor_si128(d, key[j]);
+            __m128i prod = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m128i swap = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+            a[j] = _mm_add_epi64(a[j], _mm_add_epi64(prod, swap));
+        }
+    }
+    for (j = 0; j < 4; j++) {
+        _mm_storeu_si128((__m128i *)acc + j, a[j]);
+    }
+}
+#endif
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t *acc, const unsigned char *p, size_t stripes) {
+    __m256i a0 = _mm256_loadu_si256((const __m256i *)acc);
+    __m256i a1 = _mm256_loadu_si256((const __m256i *)acc + 1);
+    __m256i k0 = _mm256_load_si256((const __m256i *)Key);
+    __m256i k1 = _mm256_load_si256((const __m256i *)Key + 1);
+    size_t s;
+
+    for (s = 0; s < stripes; s++, p += STRIPE) {
+        __m256i d0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i d1 = _mm256_loadu_si256((const __m256i *)p + 1);
+        __m256i x0 = _mm256_xor_si256(d0, k0);
+        __m256i x1 = _mm256_xor_si256(d1, k1);
+        a0 = _mm256_add_epi64(a0, _mm256_mul_epu32(x0, _mm256_shuffle_epi32(x0, _MM_SHUFFLE(0, 3, 0, 1))));
+        a1 = _mm256_add_epi64(a1, _mm256_mul_epu32(x1, _mm256_shuffle_epi32(x1, _MM_SHUFFLE(0, 3, 0, 1))));
+        a0 = _mm256_add_epi64(a0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2)));
+        a1 = _mm256_add_epi64(a1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2)));
+    }
+    _mm256_storeu_si256((__m256i *)acc, a0);
+    _mm256_storeu_si256((__m256i *)acc + 1, a1);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void accumulate_neon(uint64_t *acc, const unsigned char *p, size_t stripes) {
+    uint64x2_t a[4], key[4];
+    size_t s;
+    int j;
+
+    for (j = 0; j < 4; j++) {
+        a[j] = vld1q_u64(acc + 2 * j);
+        key[j] = vld1q_u64(Key + 2 * j);
+    }
+    for (s = 0; s < stripes; s++, p += STRIPE) {
+        for (j = 0; j < 4; j++) {
+            uint64x2_t d = vreinterpretq_u64_u8(vld1q_u8(p + 16 * j));
+            uint64x2_t k = veorq_u64(d, key[j]);
+            uint64x2_t prod = vmull_u32(vmovn_u64(k), vshrn_n_u64(k, 32));
+            a[j] = vaddq_u64(a[j], vaddq_u64(prod, vextq_u64(d, d, 1)));
+        }
+    }
+    for (j = 0; j < 4; j++) {
+        vst1q_u64(acc + 2 * j, a[j]);
+    }
+}
+#endif
+
+static struct {
+    const char *name;
+    accumulate_fn fn;
+} Kernels[] = {
+#ifdef HAVE_AVX2
+    {"avx2", accumulate_avx2},
+#endif
+#ifdef HAVE_SSE2
+    {"sse2", accumulate_sse2},
+#endif
+#ifdef HAVE_NEON
+    {"neon", accumulate_neon},
+#endif
+    {"scalar", accumulate_scalar},
+};
+
+static int Current = -1;
+
+static int kernel_usable(int i) {
+#ifdef HAVE_AVX2
+    if (Kernels[i].fn == accumulate_avx2) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    (void)i;
+    return 1;
+}
+
+static accumulate_fn kernel(void) {
+    if (Current == -1) {
+        // The first usable entry is the fastest
+        for (Current = 0; !kernel_usable(Current); Current++)
+            ;
+    }
+    return Kernels[Current].fn;
+}
+
+const char *checksum_kernel(void) {
+    kernel();
+    return Kernels[Current].name;
+}
+
+int checksum_set_kernel(const char *name) {
+    int i;
+
+    for (i = 0; i < (int)(sizeof(Kernels) / sizeof(Kernels[0])); i++) {
+        if (strcmp(Kernels[i].name, name) == 0 && kernel_usable(i)) {
+            Current = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Fold the accumulators so that every bit affects all the others */
+static void scramble(uint64_t *acc) {
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= Key[i];
+        acc[i] *= PRIME32_1;
+    }
+}
+
+static uint64_t fold64(uint64_t a, uint64_t b) {
+    unsigned __int128 m = (unsigned __int128)a * b;
+    return (uint64_t)m ^ (uint64_t)(m >> 64);
+}
+
+/* The hash in steps, so a file can be read in blocks: start, whole blocks of
+   BLOCK_STRIPES stripes, then the shorter tail with the total length */
+static void sum_start(uint64_t *acc) {
+    const uint64_t init[8] = {PRIME32_1, PRIME64_1, PRIME64_2, PRIME32_1 ^ PRIME64_2,
+                              PRIME64_1 ^ PRIME64_2, PRIME64_1 + PRIME32_1, PRIME64_2 + PRIME32_1, PRIME64_1 ^ PRIME32_1};
+    memcpy(acc, init, sizeof(init));
+}
+
+static void sum_blocks(uint64_t *acc, accumulate_fn fn, const unsigned char *p, size_t blocks) {
+    for (; blocks > 0; blocks--, p += BLOCK_STRIPES * STRIPE) {
+        fn(acc, p, BLOCK_STRIPES);
+        scramble(acc);
+    }
+}
+
+static uint64_t sum_end(uint64_t *acc, accumulate_fn fn, const unsigned char *p, size_t rest, uint64_t len) {
+    unsigned char last[STRIPE];
+    size_t stripes = rest / STRIPE;
+    uint64_t h;
+    int i;
+
+    fn(acc, p, stripes);
+    p += stripes * STRIPE;
+    rest %= STRIPE;
+    if (rest > 0) {
+        // The last partial stripe is hashed zero-padded; the length tells it apart
+        memset(last, 0, sizeof(last));
+        memcpy(last, p, rest);
+        fn(acc, last, 1);
+    }
+
+    h = len * PRIME64_1;
+    for (i = 0; i < 8; i += 2) {
+        h += fold64(acc[i] ^ Key[i] ^ PRIME64_2, acc[i + 1] ^ Key[i + 1]);
+    }
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t checksum(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t acc[8];
+    accumulate_fn fn = kernel();
+    size_t blocks = len / (BLOCK_STRIPES * STRIPE);
+
+    sum_start(acc);
+    sum_blocks(acc, fn, p, blocks);
+    p += blocks * BLOCK_STRIPES * STRIPE;
+    return sum_end(acc, fn, p, len - blocks * BLOCK_STRIPES * STRIPE, len);
+}
+
+/* Remembered sums, indexed by a hash of device and inode */
+static struct cached_sum {
+    dev_t dev;
+    ino_t ino;
+    long long mtime, ctime; /* nanoseconds */
+    off_t size;
+    uint64_t sum;
+    int valid;
+} Cache[CACHE_SIZE];
+
+int checksum_file(int fd, const struct stat *st, uint64_t *sum) {
+    struct cached_sum *c = &Cache[fold64((uint64_t)st->st_dev ^ PRIME64_2, (uint64_t)st->st_ino ^ PRIME64_1) % CACHE_SIZE];
+    accumulate_fn fn = kernel();
+    uint64_t acc[8];
+    unsigned char *buf;
+    off_t off = 0;
+    size_t fill = 0, blocks;
+    ssize_t r;
+
+    // ctime also changes when a write keeps mtime (or it is set back with utimes)
+    if (c->valid && c->dev == st->st_dev && c->ino == st->st_ino && c->mtime == files_mtime_ns(st) &&
+        c->ctime == files_ctime_ns(st) && c->size == st->st_size) {
+        *sum = c->sum;
+        return 0;
+    }
+
+    // Read in blocks rather than mmap: a file truncated while it is hashed
+    // ends the read early instead of raising SIGBUS
+    if ((buf = malloc(READ_SIZE)) == NULL) {
+        return -1;
+    }
+    sum_start(acc);
+    while (off < st->st_size) {
+        size_t want = READ_SIZE - fill;
+        if ((off_t)want > st->st_size - off) {
+            want = st->st_size - off;
+        }
+        if ((r = pread(fd, buf + fill, want, off)) <= 0) {
+            if (r == -1 && errno == EINTR) {
+                continue;
+            }
+            free(buf);
+            return -1; /* an error, or the file got shorter */
+        }
+        off += r;
+        fill += r;
+        if (fill == READ_SIZE) {
+            sum_blocks(acc, fn, buf, READ_SIZE / (BLOCK_STRIPES * STRIPE));
+            fill = 0;
+        }
+    }
+    blocks = fill / (BLOCK_STRIPES * STRIPE);
+    sum_blocks(acc, fn, buf, blocks);
+    *sum = sum_end(acc, fn, buf + blocks * BLOCK_STRIPES * STRIPE, fill - blocks * BLOCK_STRIPES * STRIPE, st->st_size);
+    free(buf);
+
+    c->dev = st->st_dev;
+    c->ino = st->st_ino;
+    c->mtime = files_mtime_ns(st);
+    c->ctime = files_ctime_ns(st);
+    c->size = st->st_size;
+    c->sum = *sum;
+    c->valid = 1;
+    return 0;
+}
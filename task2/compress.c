@@ -0,0 +1,248 @@
+/*
+  compress.c
+*/
+
+#include "compress.h"
+#include "files.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <zlib.h>
+
+#define HEADROOM 16         /* room for the chunk length in front of the data */
+
+struct zjob {
+    z_stream strm;
+    int fd;
+    off_t off, end;
+    int finished;           /* deflate() has returned Z_STREAM_END */
+    int done;               /* the terminating chunk has been returned */
+    struct stat st;
+    int cache;              /* copy being written, or -1 */
+    int failed;             /* the copy is incomplete and must not be kept */
+    char final[1024], tmp[1024 + 32];
+    unsigned char in[ZCHUNK];
+    char out[HEADROOM + ZCHUNK + 2];
+};
+
+static char Cache_dir[1024];
+static int Sweep_due = 1;   /* a file went away, so its copies may be left */
+
+void zcache_init(const char *dir) {
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        perror(dir);
+        return;
+    }
+    snprintf(Cache_dir, sizeof(Cache_dir), "%s", dir);
+}
+
+/* Name of the copy of a file: <dev>-<inode>-<mtime in ns>-<size>.gz */
+static int cache_prefix(char *buf, size_t size, const struct stat *st) {
+    return snprintf(buf, size, "%s/%llx-%llx-", Cache_dir,
+                    (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+}
+
+static void cache_name(char *buf, size_t size, const struct stat *st) {
+    int len = cache_prefix(buf, size, st);
+    snprintf(buf + len, size - len, "%llx-%llx.gz",
+             (unsigned long long)files_mtime_ns(st), (unsigned long long)st->st_size);
+}
+
+/* Remove the copies of older versions of the file just cached */
+static void cache_prune(const struct stat *st, const char *keep) {
+    char prefix[1024], path[2048];
+    DIR *dir;
+    struct dirent *ent;
+    const char *base;
+    int len = cache_prefix(prefix, sizeof(prefix), st);
+
+    base = prefix + strlen(Cache_dir) + 1;
+    len -= strlen(Cache_dir) + 1;
+    if ((dir = opendir(Cache_dir)) == NULL) {
+        return;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, base, len) == 0 && strchr(ent->d_name, '.') == strrchr(ent->d_name, '.')) {
+            snprintf(path, sizeof(path), "%s/%s", Cache_dir, ent->d_name);
+            if (strcmp(path, keep) != 0) {
+                unlink(path);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+void zcache_changed(int dirfd, const char *name) {
+    struct stat st;
+
+    if (name == NULL || fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        Sweep_due = 1;
+    }
+}
+
+void zcache_sweep(int dirfd) {
+    char **names = NULL, name[1024], path[2048];
+    const char *key;
+    int n = 0, cap = 0, i, skip = strlen(Cache_dir) + 1;
+    DIR *dir;
+    struct dirent *ent;
+    struct stat st;
+
+    if (!Sweep_due || Cache_dir[0] == '\0') {
+        return;
+    }
+    Sweep_due = 0;
+
+    // The names of the copies the files there now would have
+    if ((dir = fdopendir(dup(dirfd))) == NULL) {
+        return;
+    }
+    rewinddir(dir);
+    while ((ent = readdir(dir)) != NULL) {
+        if (fstatat(dirfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            if ((names = realloc(names, cap * sizeof(char *))) == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        cache_name(name, sizeof(name), &st);
+        names[n++] = strdup(name + skip);
+    }
+    closedir(dir);
+    qsort(names, n, sizeof(char *), compare_names);
+
+    // Remove every finished copy (one '.', in ".gz") that none of them has
+    if ((dir = opendir(Cache_dir)) != NULL) {
+        while ((ent = readdir(dir)) != NULL) {
+            key = ent->d_name;
+            if (strchr(key, '.') == NULL || strchr(key, '.') != strrchr(key, '.') || strcmp(strchr(key, '.'), ".gz") != 0 ||
+                bsearch(&key, names, n, sizeof(char *), compare_names) != NULL) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%s", Cache_dir, key);
+            unlink(path);
+        }
+        closedir(dir);
+    }
+    for (i = 0; i < n; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+struct zjob *zjob_start(int fd, const struct stat *st, int *cached) {
+    static unsigned int serial;
+    struct zjob *z;
+
+    *cached = -1;
+    if ((z = malloc(sizeof(struct zjob))) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    z->cache = -1;
+    if (Cache_dir[0] != '\0') {
+        cache_name(z->final, sizeof(z->final), st);
+        if ((*cached = open(z->final, O_RDONLY)) != -1) {
+            close(fd);
+            free(z);
+            return NULL;
+        }
+        // Written under a private name and renamed when complete, so a
+        // reader never sees half a copy
+        snprintf(z->tmp, sizeof(z->tmp), "%s.%d.%u", z->final, (int)getpid(), serial++);
+        z->cache = open(z->tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    }
+
+    memset(&z->strm, 0, sizeof(z->strm));
+    // windowBits 15 + 16: a gzip stream, so the joined chunks are a .gz file
+    if (deflateInit2(&z->strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2 failed\n");
+        exit(EXIT_FAILURE);
+    }
+    z->fd = fd;
+    z->st = *st;
+    z->off = 0;
+    z->end = st->st_size;
+    z->finished = z->done = z->failed = 0;
+    return z;
+}
+
+/* Put the chunk header in front of len bytes at out + HEADROOM */
+static size_t frame(struct zjob *z, size_t len, const char **data) {
+    char header[HEADROOM];
+    int hlen = snprintf(header, sizeof(header), "%zx\r\n", len);
+    char *start = z->out + HEADROOM - hlen;
+
+    memcpy(start, header, hlen);
+    memcpy(z->out + HEADROOM + len, "\r\n", 2);
+    len += hlen + 2;
+    if (z->cache != -1 && write(z->cache, start, len) != (ssize_t)len) {
+        z->failed = 1;
+    }
+    *data = start;
+    return len;
+}
+
+ssize_t zjob_next(struct zjob *z, const char **data) {
+    if (z->done) {
+        return 0;
+    }
+    while (!z->finished) {
+        if (z->strm.avail_in == 0 && z->off < z->end) {
+            size_t want = z->end - z->off < ZCHUNK ? z->end - z->off : ZCHUNK;
+            ssize_t r = pread(z->fd, z->in, want, z->off);
+            if (r <= 0) {
+                // The file shrank or failed. A clean end would pass for the
+                // whole file, so leave the stream unfinished instead
+                z->failed = 1;
+                z->done = 1;
+                return -1;
+            }
+            z->off += r;
+            z->strm.next_in = z->in;
+            z->strm.avail_in = r;
+        }
+        z->strm.next_out = (unsigned char *)z->out + HEADROOM;
+        z->strm.avail_out = ZCHUNK;
+        if (deflate(&z->strm, z->off < z->end ? Z_NO_FLUSH : Z_FINISH) == Z_STREAM_END) {
+            z->finished = 1;
+        }
+        if (z->strm.avail_out < ZCHUNK) {
+            return frame(z, ZCHUNK - z->strm.avail_out, data);
+        }
+    }
+    // An empty chunk ends the reply
+    z->done = 1;
+    return frame(z, 0, data);
+}
+
+void zjob_end(struct zjob *z) {
+    struct stat now;
+
+    if (z->cache != -1) {
+        close(z->cache);
+        // Keep the copy only if it is whole and the file did not change
+        if (z->done && !z->failed && fstat(z->fd, &now) == 0 &&
+            files_mtime_ns(&now) == files_mtime_ns(&z->st) && now.st_size == z->st.st_size &&
+            rename(z->tmp, z->final) == 0) {
+            cache_prune(&z->st, z->final);
+        } else {
+            unlink(z->tmp);
+        }
+    }
+    deflateEnd(&z->strm);
+    close(z->fd);
+    free(z);
+}
@@ -0,0 +1,47 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+/*
+  compress.h
+  Streaming gzip compression for task2 ztype.
+  A file is deflated a fixed-size block at a time, so only one block of
+  input and output is held per transfer. The reply is a series of chunks,
+  each "<hex length>\r\n<gzip data>\r\n", ending with "0\r\n\r\n". The
+  framed reply is also written to a cache file keyed by the file's device,
+  inode, mtime (in nanoseconds) and size, and is sent from there while the
+  file is unchanged.
+*/
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define ZCHUNK 16384        /* bytes of the file deflated per step */
+
+struct zjob;
+
+/* Use dir for compressed copies (created if needed). Without a cache
+   directory every ztype compresses the file again. */
+void zcache_init(const char *dir);
+
+/* name in dirfd changed, appeared or went away (NULL: anything may have
+   changed). A file that went away makes the next zcache_sweep() run. */
+void zcache_changed(int dirfd, const char *name);
+
+/* Remove the copies that no file in dirfd matches any more, if a file has
+   gone away since the last sweep (or this is the first). Copies of files in
+   subdirectories are removed too; they are made again when asked for. */
+void zcache_sweep(int dirfd);
+
+/* Start sending fd (described by st) compressed. When a cached copy is
+   current, returns NULL and *cached is an open descriptor of that copy
+   (fd is closed). Otherwise returns a job that owns fd, and *cached is -1. */
+struct zjob *zjob_start(int fd, const struct stat *st, int *cached);
+
+/* Produce the next framed chunk. Returns its length and sets *data, 0 when
+   the terminating chunk has already been returned, or -1 when the file
+   could not be read to its end (it shrank): the reply must then be cut
+   short, since no terminating chunk follows. */
+ssize_t zjob_next(struct zjob *z, const char **data);
+
+/* Finish the job and free it. A complete copy goes into the cache. */
+void zjob_end(struct zjob *z);
+
+#endif /* COMPRESS_H_ */
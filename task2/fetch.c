@@ -0,0 +1,534 @@
+/*
+
+    --- コンパイルコマンド ---
+    gcc -I../mynet -L../mynet -o fetch fetch.c -lmynet -lpthread
+    または、makefileを使用して make コマンドによるコンパイル
+
+    --- 実行例 ---
+
+    ./task2 50000 &
+    ./fetch -n 4 localhost 50000 big.txt big.copy
+
+    Downloads one file from the task2 file server. It asks for the size with
+    `size <file>`, splits the file into <connections> ranges and fetches each
+    range over its own session with `type <file> <offset> <length>`, writing
+    it at its place in the output file. Each session is in batch mode, so an
+    error or a file that changed size is told apart from the data. A range
+    whose connection fails is fetched again from where it stopped. While it
+    runs, <output>.progress records how far every range got; it is removed
+    when the whole file has arrived. With -r an interrupted fetch is resumed
+    from that record, range by range. Without one, the existing output file
+    is taken as an already downloaded beginning of the file and only the
+    rest is fetched.
+    With -z the file is fetched compressed with `ztype <file>` over one
+    connection and inflated on the way to the output file.
+
+    ./fetch -b localhost 50000 a.txt b.txt c.txt ...
+
+    With -b every named file is fetched over one session in batch mode: all
+    the type commands go out in one send, and the framed replies are split
+    and saved under the files' names in the current directory. With -w
+    each command waits for the reply to the previous one, for comparison.
+
+*/
+
+#include "mynet.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define DEFAULT_CONNECTIONS 1
+#define MAX_RETRIES 5
+#define PASSWORD "password"
+#define RECVSIZE 65536
+#define PROGRESS_SUFFIX ".progress"
+#define PROGRESS_RECORD 42  /* "%20lld %20lld\n": the header, then one per range */
+
+struct range {
+    pthread_t tid;
+    int index;
+    long long offset, end;  /* still to fetch: [offset, end) */
+    int ok;
+};
+
+static struct sockaddr_in server_adrs;
+static char *file_name;
+static int out_fd, progress_fd = -1;
+
+static double now_sec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Receive until the data ends with suffix. Returns 0 on a closed or failed
+   connection. What came before the suffix is kept in buf when it fits. */
+static int recv_until(int sock, const char *suffix, char *buf, int size) {
+    int len = 0, slen = strlen(suffix), r;
+    char c;
+
+    while (1) {
+        if ((r = recv(sock, &c, 1, 0)) <= 0) {
+            return 0;
+        }
+        if (len < size - 1) {
+            buf[len++] = c;
+        } else {
+            memmove(buf, buf + 1, len - 1);
+            buf[len - 1] = c;
+        }
+        buf[len] = '\0';
+        if (len >= slen && strcmp(buf + len - slen, suffix) == 0) {
+            return 1;
+        }
+    }
+}
+
+/* Connect and log in. Returns the socket at the first prompt, or -1. */
+static int login(void) {
+    char buf[256];
+    int sock;
+
+    if ((sock = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&server_adrs, sizeof(server_adrs)) == -1 ||
+        !recv_until(sock, "password: ", buf, sizeof(buf)) ||
+        send(sock, PASSWORD "\n", strlen(PASSWORD) + 1, 0) == -1 ||
+        !recv_until(sock, "> ", buf, sizeof(buf))) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* Write record slot of the progress file: the file size and the number of
+   ranges in slot 0, where a range stands and where it ends after that */
+static void write_progress(int slot, long long a, long long b) {
+    char rec[PROGRESS_RECORD + 1];
+
+    snprintf(rec, sizeof(rec), "%20lld %20lld\n", a, b);
+    if (pwrite(progress_fd, rec, PROGRESS_RECORD, (off_t)slot * PROGRESS_RECORD) != PROGRESS_RECORD) {
+        exit_errmesg("pwrite()");
+    }
+}
+
+/* Read the ranges an interrupted fetch of a size byte file left in the
+   progress file path. Returns NULL when there is no usable record. */
+static struct range *load_progress(const char *path, long long size, int *n_ranges) {
+    struct range *ranges;
+    char rec[PROGRESS_RECORD + 1];
+    long long a, b;
+    int fd, i, n;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        return NULL;
+    }
+    rec[PROGRESS_RECORD] = '\0';
+    if (pread(fd, rec, PROGRESS_RECORD, 0) != PROGRESS_RECORD || sscanf(rec, "%lld %lld", &a, &b) != 2 ||
+        a != size || b <= 0 || b > 100000 || (ranges = calloc(b, sizeof(struct range))) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    n = b;
+    for (i = 0; i < n; i++) {
+        if (pread(fd, rec, PROGRESS_RECORD, (off_t)(i + 1) * PROGRESS_RECORD) != PROGRESS_RECORD ||
+            sscanf(rec, "%lld %lld", &a, &b) != 2 || a < 0 || a > b || b > size) {
+            free(ranges);
+            close(fd);
+            return NULL;
+        }
+        ranges[i].offset = a;
+        ranges[i].end = b;
+    }
+    close(fd);
+    *n_ranges = n;
+    return ranges;
+}
+
+/* Fetch one range over one session. Returns 0 when the connection failed
+   (r->offset tells how far it got) and -1 when the server refused it. */
+static int fetch_range(struct range *r) {
+    char buf[RECVSIZE];
+    long long len;
+    int sock, n;
+
+    if ((sock = login()) == -1) {
+        return 0;
+    }
+    // In batch mode the data comes as "+<length>\r\n" and an error as
+    // "-<message>\r\n", after the "+0\r\n" of the batch command itself
+    n = snprintf(buf, sizeof(buf), "batch\ntype %s %lld %lld\n", file_name, r->offset, r->end - r->offset);
+    if (send(sock, buf, n, 0) != n || !recv_until(sock, "\r\n", buf, sizeof(buf)) ||
+        !recv_until(sock, "\r\n", buf, sizeof(buf))) {
+        close(sock);
+        return 0;
+    }
+    if (buf[0] != '+' || (len = atoll(buf + 1)) != r->end - r->offset) {
+        if (buf[0] == '+') {
+            fprintf(stderr, "%s: the file changed size during the fetch\n", file_name);
+        } else {
+            fprintf(stderr, "%s: %s", file_name, buf + 1);
+        }
+        send(sock, "exit\n", 5, 0);
+        close(sock);
+        return -1;
+    }
+    while (r->offset < r->end) {
+        long long want = r->end - r->offset;
+        if ((n = recv(sock, buf, want < RECVSIZE ? want : RECVSIZE, 0)) <= 0) {
+            close(sock);
+            return 0;
+        }
+        if (pwrite(out_fd, buf, n, r->offset) != n) {
+            exit_errmesg("pwrite()");
+        }
+        r->offset += n;
+        write_progress(r->index + 1, r->offset, r->end);
+    }
+    send(sock, "exit\n", 5, 0);
+    close(sock);
+    return 1;
+}
+
+static void *range_thread(void *arg) {
+    struct range *r = (struct range *)arg;
+    int tries, result;
+
+    if (r->offset == r->end) { /* finished before an interruption */
+        r->ok = 1;
+        return NULL;
+    }
+    for (tries = 0; tries <= MAX_RETRIES; tries++) {
+        if ((result = fetch_range(r)) != 0) {
+            r->ok = result == 1;
+            break;
+        }
+        fprintf(stderr, "range ending at %lld: connection lost at %lld, retrying\n", r->end, r->offset);
+        usleep(100000 << tries);
+    }
+    return NULL;
+}
+
+/* Ask the server how large the file is. Returns -1 when it does not exist. */
+static long long file_size(void) {
+    char buf[256];
+    long long size = -1;
+    int sock, n;
+
+    if ((sock = login()) == -1) {
+        exit_errmesg("login");
+    }
+    n = snprintf(buf, sizeof(buf), "size %s\n", file_name);
+    if (send(sock, buf, n, 0) != n || !recv_until(sock, "> ", buf, sizeof(buf))) {
+        exit_errmesg("size");
+    }
+    if (buf[0] >= '0' && buf[0] <= '9') {
+        size = atoll(buf);
+    } else {
+        fprintf(stderr, "%s: %s", file_name, buf);
+    }
+    send(sock, "exit\n", 5, 0);
+    close(sock);
+    return size;
+}
+
+/* Fetch the file with ztype and inflate it into out_fd. Returns the bytes
+   received (chunk framing included) or -1. */
+static long long fetch_compressed(void) {
+    static unsigned char in[RECVSIZE], out[RECVSIZE];
+    char line[64];
+    z_stream strm;
+    long long wire = 0, written = 0;
+    int sock, n, ret = Z_OK;
+    long chunk;
+
+    if ((sock = login()) == -1) {
+        return -1;
+    }
+    n = snprintf(line, sizeof(line), "ztype %s\n", file_name);
+    if (send(sock, line, n, 0) != n) {
+        close(sock);
+        return -1;
+    }
+    memset(&strm, 0, sizeof(strm));
+    inflateInit2(&strm, 15 + 16);
+
+    // Chunks of "<hex length>\r\n<data>\r\n" up to an empty one
+    while (recv_until(sock, "\r\n", line, sizeof(line)) && (chunk = strtol(line, NULL, 16)) > 0) {
+        wire += strlen(line) + chunk + 2;
+        while (chunk > 0) {
+            if ((n = recv(sock, in, chunk < RECVSIZE ? chunk : RECVSIZE, 0)) <= 0) {
+                break;
+            }
+            chunk -= n;
+            strm.next_in = in;
+            strm.avail_in = n;
+            do {
+                strm.next_out = out;
+                strm.avail_out = sizeof(out);
+                ret = inflate(&strm, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                    fprintf(stderr, "inflate: %s\n", strm.msg ? strm.msg : "error");
+                    exit(EXIT_FAILURE);
+                }
+                if (write(out_fd, out, sizeof(out) - strm.avail_out) == -1) {
+                    exit_errmesg("write()");
+                }
+                written += sizeof(out) - strm.avail_out;
+            } while (strm.avail_out == 0);
+        }
+        if (chunk > 0 || !recv_until(sock, "\r\n", line, sizeof(line))) {
+            break;
+        }
+    }
+    inflateEnd(&strm);
+    n = ret == Z_STREAM_END && recv_until(sock, "> ", line, sizeof(line));
+    send(sock, "exit\n", 5, 0);
+    close(sock);
+    if (!n) {
+        fprintf(stderr, "%s: compressed transfer ended early after %lld bytes\n", file_name, written);
+        return -1;
+    }
+    return wire + 5;
+}
+
+/* Buffered reading of batch replies */
+static char rbuf[RECVSIZE];
+static int rpos, rlen;
+
+static int read_byte(int sock) {
+    if (rpos == rlen) {
+        if ((rlen = recv(sock, rbuf, sizeof(rbuf), 0)) <= 0) {
+            return -1;
+        }
+        rpos = 0;
+    }
+    return (unsigned char)rbuf[rpos++];
+}
+
+/* Read one batch reply: "+<length>\r\n" and the body, written to fd, or
+   "-<message>\r\n". Returns the body length, -1 for an error reply (the
+   message is in line), or -2 when the connection failed. */
+static long long read_reply(int sock, int fd, char *line, int size) {
+    long long len, left;
+    int n = 0, c;
+
+    while ((c = read_byte(sock)) != -1 && c != '\n') {
+        if (n < size - 1) {
+            line[n++] = c;
+        }
+    }
+    line[n] = '\0';
+    if (c == -1) {
+        return -2;
+    }
+    if (line[0] != '+') {
+        return -1;
+    }
+    left = len = atoll(line + 1);
+    while (left > 0) {
+        if (rpos == rlen && read_byte(sock) != -1) {
+            rpos--; /* refill, then use the buffer directly */
+        }
+        if (rpos == rlen) {
+            return -2;
+        }
+        n = rlen - rpos < left ? rlen - rpos : left;
+        if (fd != -1 && write(fd, rbuf + rpos, n) != n) {
+            exit_errmesg("write()");
+        }
+        rpos += n;
+        left -= n;
+    }
+    return len;
+}
+
+/* Fetch the named files over one batch session. Returns 0 when all came. */
+static int fetch_batch(char **names, int n, int wait_each) {
+    char line[1024], *cmd = NULL;
+    size_t cmd_len = 0, cmd_cap = 0;
+    long long total = 0, len;
+    int sock, i, sent = 0, failed = 0, fd;
+
+    if ((sock = login()) == -1) {
+        exit_errmesg("login");
+    }
+    for (i = -1; i < n; i++) {
+        int l = i < 0 ? snprintf(line, sizeof(line), "batch\n") : snprintf(line, sizeof(line), "type %s\n", names[i]);
+        if (cmd_len + l > cmd_cap) {
+            cmd_cap = cmd_cap ? cmd_cap * 2 : 65536;
+            if ((cmd = realloc(cmd, cmd_cap)) == NULL) {
+                exit_errmesg("realloc()");
+            }
+        }
+        memcpy(cmd + cmd_len, line, l);
+        cmd_len += l;
+    }
+
+    double begin = now_sec();
+    if (!wait_each) {
+        // Every command in one go; the server answers them back to back
+        if (send(sock, cmd, cmd_len, 0) != (ssize_t)cmd_len) {
+            exit_errmesg("send()");
+        }
+        sent = n + 1;
+    }
+    for (i = -1; i < n; i++) {
+        if (wait_each) {
+            char *end = strchr(cmd + sent, '\n') + 1;
+            if (send(sock, cmd + sent, end - (cmd + sent), 0) == -1) {
+                exit_errmesg("send()");
+            }
+            sent = end - cmd;
+        }
+        fd = -1;
+        if (i >= 0) {
+            const char *base = strrchr(names[i], '/') ? strrchr(names[i], '/') + 1 : names[i];
+            if ((fd = open(base, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+                exit_errmesg((char *)base);
+            }
+        }
+        len = read_reply(sock, fd, line, sizeof(line));
+        if (fd != -1) {
+            close(fd);
+        }
+        if (len == -2) {
+            fprintf(stderr, "connection lost\n");
+            exit(EXIT_FAILURE);
+        }
+        if (len == -1) {
+            fprintf(stderr, "%s: %s\n", i >= 0 ? names[i] : "batch", line + 1);
+            failed++;
+        } else {
+            total += len;
+        }
+    }
+    double elapsed = now_sec() - begin;
+    send(sock, "exit\n", 5, 0);
+    close(sock);
+    free(cmd);
+
+    printf("%d files, %lld bytes in %.3f sec (%s), %d failed\n",
+           n, total, elapsed, wait_each ? "one command at a time" : "pipelined", failed);
+    return failed ? -1 : 0;
+}
+
+static void print_usage(char *program_name) {
+    fprintf(stderr, "Usage: %s [-n connections] [-r] [-z] <server> <port_number> <file> [output]\n"
+                    "       %s -b [-w] <server> <port_number> <file>...\n", program_name, program_name);
+}
+
+int main(int argc, char *argv[]) {
+    int n_ranges = DEFAULT_CONNECTIONS, resume = 0, compressed = 0, batch = 0, wait_each = 0;
+    struct range *ranges = NULL;
+    struct stat st;
+    long long size, start = 0, chunk, todo = 0;
+    char *output, progress[1024];
+    int c, i, failed = 0;
+
+    while ((c = getopt(argc, argv, "n:rzbwh")) != -1) {
+        switch (c) {
+        case 'n':
+            n_ranges = atoi(optarg);
+            break;
+        case 'r':
+            resume = 1;
+            break;
+        case 'z':
+            compressed = 1;
+            break;
+        case 'b':
+            batch = 1;
+            break;
+        case 'w':
+            wait_each = 1;
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind < 3 || (argc - optind > 4 && !batch) || n_ranges <= 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    set_sockaddr_in(&server_adrs, argv[optind], atoi(argv[optind + 1]));
+    if (batch) {
+        return fetch_batch(argv + optind + 2, argc - optind - 2, wait_each) == 0 ? 0 : EXIT_FAILURE;
+    }
+    file_name = argv[optind + 2];
+    output = argc - optind == 4 ? argv[optind + 3] : file_name;
+
+    if ((size = file_size()) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    if ((out_fd = open(output, O_WRONLY | O_CREAT | (resume && !compressed ? 0 : O_TRUNC), 0644)) == -1) {
+        exit_errmesg(output);
+    }
+    snprintf(progress, sizeof(progress), "%s" PROGRESS_SUFFIX, output);
+    if (resume && !compressed && (ranges = load_progress(progress, size, &n_ranges)) != NULL) {
+        // The ranges of an interrupted fetch go on where each one stopped;
+        // the output file may have holes before their ends
+    } else if (resume && !compressed && fstat(out_fd, &st) == 0) {
+        if (st.st_size <= size) {
+            start = st.st_size;
+        } else if (ftruncate(out_fd, 0) == -1) { /* not a beginning of this file */
+            exit_errmesg("ftruncate()");
+        }
+    }
+    if (compressed) {
+        double begin = now_sec();
+        long long wire = fetch_compressed();
+        if (wire == -1) {
+            exit(EXIT_FAILURE);
+        }
+        double elapsed = now_sec() - begin;
+        close(out_fd);
+        printf("%s: %lld bytes in %.3f sec, %lld bytes on the wire (%.1f%%)\n",
+               output, size, elapsed, wire, size ? 100.0 * wire / size : 0.0);
+        return 0;
+    }
+
+    if (ranges == NULL) {
+        if ((ranges = calloc(n_ranges, sizeof(struct range))) == NULL) {
+            exit_errmesg("calloc()");
+        }
+        chunk = (size - start + n_ranges - 1) / n_ranges;
+        for (i = 0; i < n_ranges; i++) {
+            ranges[i].offset = start + chunk * i < size ? start + chunk * i : size;
+            ranges[i].end = ranges[i].offset + chunk < size ? ranges[i].offset + chunk : size;
+        }
+    }
+    if ((progress_fd = open(progress, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+        exit_errmesg(progress);
+    }
+    write_progress(0, size, n_ranges);
+    for (i = 0; i < n_ranges; i++) {
+        ranges[i].index = i;
+        write_progress(i + 1, ranges[i].offset, ranges[i].end);
+        todo += ranges[i].end - ranges[i].offset;
+    }
+    double begin = now_sec();
+    for (i = 0; i < n_ranges; i++) {
+        pthread_create(&ranges[i].tid, NULL, range_thread, &ranges[i]);
+    }
+    for (i = 0; i < n_ranges; i++) {
+        pthread_join(ranges[i].tid, NULL);
+        failed += !ranges[i].ok;
+    }
+    double elapsed = now_sec() - begin;
+    close(out_fd);
+    close(progress_fd);
+
+    if (failed) {
+        fprintf(stderr, "%d of %d ranges failed; -r goes on from %s\n", failed, n_ranges, progress);
+        exit(EXIT_FAILURE);
+    }
+    unlink(progress);
+    printf("%s: %lld bytes (%lld fetched) in %.3f sec over %d connections, %.1f MB/s\n",
+           output, size, todo, elapsed, n_ranges, todo / elapsed / 1e6);
+    return 0;
+}
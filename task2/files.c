@@ -0,0 +1,107 @@
+/*
+  files.c
+*/
+
+#include "files.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#define SEND_BLOCK 65536    /* block size when sendfile() is not available */
+
+int files_open_dir(const char *path) {
+    return open(path, O_RDONLY | O_DIRECTORY);
+}
+
+int files_open(int dirfd, const char *name, struct stat *st) {
+    char path[1024];
+    char *part, *next;
+    int fd = dirfd, sub;
+
+    if (snprintf(path, sizeof(path), "%s", name) >= (int)sizeof(path)) {
+        return -1;
+    }
+
+    // Walk the name one component at a time, like openat2(RESOLVE_BENEATH)
+    for (part = path; ; part = next) {
+        part += strspn(part, "/");
+        next = part + strcspn(part, "/");
+        int last = next[strspn(next, "/")] == '\0';
+        if (*next != '\0') {
+            *next++ = '\0';
+        }
+
+        if (strcmp(part, "..") == 0) {
+            sub = FILES_PARENT;
+        } else if (*part == '\0' || strcmp(part, ".") == 0) {
+            sub = last ? -1 : dup(fd); /* "" or "." only as a step on the way */
+        } else {
+            // O_NONBLOCK: opening a FIFO must not wait for a writer and stall
+            // every session; it is turned away below as not a regular file
+            sub = openat(fd, part, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC | (last ? 0 : O_DIRECTORY));
+        }
+        if (fd != dirfd) {
+            close(fd);
+        }
+        if (sub < 0 || last) {
+            fd = sub;
+            break;
+        }
+        fd = sub;
+    }
+
+    if (fd >= 0 && (fstat(fd, st) == -1 || !S_ISREG(st->st_mode))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int files_listed(int dirfd, const char *name, struct stat *st) {
+    size_t l = strlen(name);
+
+    if (l < 5 || strcmp(name + l - 4, ".txt") != 0 || name[0] == '.') {
+        return 0;
+    }
+    return fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st->st_mode);
+}
+
+void files_advise(int fd, off_t offset, off_t length) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    // Read ahead aggressively over the range and start reading it now
+    posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+#else
+    (void)fd; (void)offset; (void)length;
+#endif
+}
+
+ssize_t files_send(int sock, int fd, off_t *offset, size_t count) {
+#ifdef __linux__
+    ssize_t r = sendfile(sock, fd, offset, count);
+    if (r != -1 || (errno != EINVAL && errno != ENOSYS)) {
+        return r;
+    }
+#endif
+    // Fallback: large blocks through user space
+    char block[SEND_BLOCK];
+    ssize_t got, sent;
+
+    if (count > sizeof(block)) {
+        count = sizeof(block);
+    }
+    if ((got = pread(fd, block, count, *offset)) <= 0) {
+        return got;
+    }
+    if ((sent = send(sock, block, got, 0)) > 0) {
+        *offset += sent;
+    }
+    return sent;
+}
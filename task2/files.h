@@ -0,0 +1,45 @@
+#ifndef FILES_H_
+#define FILES_H_
+/*
+  files.h
+  In-process access to the work directory served by task2.
+  Every lookup is made relative to a directory descriptor, so a name can
+  never leave the work directory.
+*/
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define FILES_PARENT (-2)   /* the name tried to go up with ".." */
+
+/* Modification and status change times in nanoseconds, so that a file
+   rewritten twice within one second still looks changed */
+#define FILES_NS(ts) ((long long)(ts).tv_sec * 1000000000 + (ts).tv_nsec)
+#ifdef __APPLE__
+static inline long long files_mtime_ns(const struct stat *st) { return FILES_NS(st->st_mtimespec); }
+static inline long long files_ctime_ns(const struct stat *st) { return FILES_NS(st->st_ctimespec); }
+#else
+static inline long long files_mtime_ns(const struct stat *st) { return FILES_NS(st->st_mtim); }
+static inline long long files_ctime_ns(const struct stat *st) { return FILES_NS(st->st_ctim); }
+#endif
+
+/* Open the work directory. Returns a directory descriptor or -1. */
+int files_open_dir(const char *path);
+
+/* Open a regular file below dirfd without following "..", symbolic links
+   or absolute paths. Fills *st on success. Returns the descriptor, -1 when
+   there is no such file, or FILES_PARENT. */
+int files_open(int dirfd, const char *name, struct stat *st);
+
+/* Whether name in dirfd belongs in the listing: a *.txt regular file that
+   is not hidden. Fills *st when it does. */
+int files_listed(int dirfd, const char *name, struct stat *st);
+
+/* Tell the kernel the range of fd is about to be read from start to end. */
+void files_advise(int fd, off_t offset, off_t length);
+
+/* Send up to count bytes of fd from *offset to sock and advance *offset.
+   Uses sendfile() where available. Returns the bytes sent or -1 (errno is
+   EAGAIN when a nonblocking socket is full). */
+ssize_t files_send(int sock, int fd, off_t *offset, size_t count);
+
+#endif /* FILES_H_ */
@@ -0,0 +1,512 @@
+/*
+  index.c
+*/
+
+#include "index.h"
+#include "files.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define MAX_WORD 64         /* longer words are indexed by their first bytes */
+#define MAX_TERMS 8         /* words in one query */
+#define MAX_RESULTS 1000    /* lines returned by one query */
+#define SHOW_LINE 200       /* bytes of each matching line returned */
+#define INDEX_MAX_FILE (16 << 20)   /* larger files are scanned at query time */
+#define READ_SIZE (64 * 1024)       /* bytes read at a time from a file */
+
+struct posting {
+    uint32_t file, line;
+};
+
+struct word {
+    char *text;             /* NULL for a free slot */
+    struct posting *p;      /* sorted by file, then line */
+    uint32_t n, cap;
+};
+
+struct ifile {
+    char *name;
+    int live;               /* 0 once removed or indexed again under a new number */
+    int stale;              /* changed since it was indexed */
+    int indexed;
+    int scanned;            /* too large for the index: searched line by line */
+    ino_t ino;
+    long long mtime;        /* nanoseconds */
+    off_t size;
+    off_t *lines;           /* where each line starts */
+    uint32_t n_lines;
+    size_t n_postings;
+};
+
+static int Dir = -1;
+static struct word *Words;  /* open addressing, a power of two in size */
+static size_t N_words, Cap_words;
+static struct ifile *Files; /* numbered in the order they were indexed */
+static int N_files, Cap_files, Dead_files;
+static size_t Live_postings, Dead_postings;
+
+static int is_word_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+/* Copy a word lowered and cut to MAX_WORD; returns its length */
+static int fold_word(char *out, const unsigned char *p, size_t len) {
+    int i, n = len < MAX_WORD ? len : MAX_WORD;
+
+    for (i = 0; i < n; i++) {
+        out[i] = p[i] >= 'A' && p[i] <= 'Z' ? p[i] - 'A' + 'a' : p[i];
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static size_t hash_word(const char *w) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*w) {
+        h = (h ^ (unsigned char)*w++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static struct word *find_word(const char *w, int create) {
+    size_t i;
+
+    if (create && (N_words + 1) * 10 > Cap_words * 7) {
+        // Grow and put every word in its new place
+        struct word *old = Words;
+        size_t old_cap = Cap_words, j;
+        Cap_words = Cap_words ? Cap_words * 2 : 4096;
+        if ((Words = calloc(Cap_words, sizeof(struct word))) == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (j = 0; j < old_cap; j++) {
+            if (old[j].text != NULL) {
+                for (i = hash_word(old[j].text) & (Cap_words - 1); Words[i].text != NULL; i = (i + 1) & (Cap_words - 1))
+                    ;
+                Words[i] = old[j];
+            }
+        }
+        free(old);
+    }
+    if (Cap_words == 0) {
+        return NULL;
+    }
+    for (i = hash_word(w) & (Cap_words - 1); Words[i].text != NULL; i = (i + 1) & (Cap_words - 1)) {
+        if (strcmp(Words[i].text, w) == 0) {
+            return &Words[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    Words[i].text = strdup(w);
+    N_words++;
+    return &Words[i];
+}
+
+static void add_posting(int file, uint32_t line, const char *w) {
+    struct word *wd = find_word(w, 1);
+
+    // A word repeated on one line is posted once
+    if (wd->n > 0 && wd->p[wd->n - 1].file == (uint32_t)file && wd->p[wd->n - 1].line == line) {
+        return;
+    }
+    if (wd->n == wd->cap) {
+        wd->cap = wd->cap ? wd->cap * 2 : 4;
+        if ((wd->p = realloc(wd->p, wd->cap * sizeof(struct posting))) == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    wd->p[wd->n].file = file;
+    wd->p[wd->n].line = line;
+    wd->n++;
+    Files[file].n_postings++;
+    Live_postings++;
+}
+
+static int add_file(const char *name) {
+    if (N_files == Cap_files) {
+        Cap_files = Cap_files ? Cap_files * 2 : 256;
+        if ((Files = realloc(Files, Cap_files * sizeof(struct ifile))) == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memset(&Files[N_files], 0, sizeof(struct ifile));
+    Files[N_files].name = strdup(name);
+    Files[N_files].live = 1;
+    Files[N_files].stale = 1;
+    return N_files++;
+}
+
+/* Forget a file; its postings are skipped until the next compaction */
+static void drop_file(int id) {
+    struct ifile *f = &Files[id];
+
+    f->live = 0;
+    Dead_files++;
+    Live_postings -= f->n_postings;
+    Dead_postings += f->n_postings;
+    free(f->lines);
+    f->lines = NULL;
+    free(f->name);
+    f->name = NULL;
+}
+
+/* Drop the postings and entries of forgotten files. The others keep their
+   order under smaller numbers, so every posting list stays sorted. */
+static void compact(void) {
+    uint32_t *renum, j, n;
+    size_t i;
+    int id, n_live = 0;
+
+    if ((renum = malloc((N_files + 1) * sizeof(uint32_t))) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (id = 0; id < N_files; id++) {
+        renum[id] = Files[id].live ? (uint32_t)n_live++ : UINT32_MAX;
+    }
+    for (i = 0; i < Cap_words; i++) {
+        struct word *wd = &Words[i];
+        if (wd->text == NULL) {
+            continue;
+        }
+        for (j = n = 0; j < wd->n; j++) {
+            if (renum[wd->p[j].file] != UINT32_MAX) {
+                wd->p[n].file = renum[wd->p[j].file];
+                wd->p[n++].line = wd->p[j].line;
+            }
+        }
+        wd->n = n;
+    }
+    for (id = 0; id < N_files; id++) {
+        if (Files[id].live) {
+            Files[renum[id]] = Files[id];
+        }
+    }
+    free(renum);
+    N_files = n_live;
+    Dead_files = 0;
+    Dead_postings = 0;
+}
+
+/* Called for every word of a file, folded */
+typedef void (*word_fn)(void *arg, const char *w);
+/* Called at the end of every line with where it starts and its first
+   bytes; nonzero stops the walk */
+typedef int (*line_fn)(void *arg, off_t start, const unsigned char *text, size_t len);
+
+/* Read the file of an index entry in blocks and split it into lines and
+   words. It is read rather than mapped, so a file cut short meanwhile just
+   ends early instead of raising SIGBUS. Returns -1 when it cannot be opened. */
+static int walk_file(struct ifile *f, word_fn on_word, line_fn on_line, void *arg) {
+    unsigned char buf[READ_SIZE], text[SHOW_LINE + 1], raw[MAX_WORD];
+    char w[MAX_WORD + 1];
+    struct stat st;
+    off_t off = 0, start = 0;
+    size_t text_len = 0, word_len = 0, i;
+    ssize_t got;
+    int fd = files_open(Dir, f->name, &st), stop = 0;
+
+    if (fd < 0) {
+        return -1;
+    }
+    files_advise(fd, 0, st.st_size);
+    while (!stop) {
+        if ((got = pread(fd, buf, sizeof(buf), off)) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        for (i = 0; i < (size_t)got && !stop; i++) {
+            if (is_word_byte(buf[i])) {
+                // Words longer than MAX_WORD are indexed by their first bytes
+                if (word_len < MAX_WORD) {
+                    raw[word_len] = buf[i];
+                }
+                word_len++;
+            } else if (word_len > 0) {
+                fold_word(w, raw, word_len);
+                on_word(arg, w);
+                word_len = 0;
+            }
+            if (buf[i] == '\n') {
+                stop = on_line(arg, start, text, text_len);
+                start = off + i + 1;
+                text_len = 0;
+            } else if (text_len < sizeof(text)) {
+                text[text_len++] = buf[i];
+            }
+        }
+        off += got;
+    }
+    close(fd);
+    if (!stop && word_len > 0) {
+        fold_word(w, raw, word_len);
+        on_word(arg, w);
+    }
+    if (!stop && off > start) {
+        on_line(arg, start, text, text_len);
+    }
+    return 0;
+}
+
+struct indexing {
+    int id;
+    size_t cap;
+};
+
+static void index_word(void *arg, const char *w) {
+    struct indexing *x = arg;
+
+    add_posting(x->id, Files[x->id].n_lines, w);
+}
+
+static int index_line(void *arg, off_t start, const unsigned char *text, size_t len) {
+    struct indexing *x = arg;
+    struct ifile *f = &Files[x->id];
+
+    (void)text;
+    (void)len;
+    if (f->n_lines == x->cap) {
+        x->cap = x->cap ? x->cap * 2 : 64;
+        if ((f->lines = realloc(f->lines, x->cap * sizeof(off_t))) == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    f->lines[f->n_lines++] = start;
+    return 0;
+}
+
+static void index_file(int id, const struct stat *st) {
+    struct ifile *f = &Files[id];
+    struct indexing x = {id, 0};
+
+    f->indexed = 1;
+    f->ino = st->st_ino;
+    f->mtime = files_mtime_ns(st);
+    f->size = st->st_size;
+    f->n_lines = 0;
+    if (!(f->scanned = st->st_size > INDEX_MAX_FILE)) {
+        walk_file(f, index_word, index_line, &x);
+    }
+}
+
+void index_init(int dirfd) {
+    Dir = dirfd;
+}
+
+void index_changed(int dirfd, const char *name) {
+    struct stat st;
+    int i;
+
+    for (i = 0; i < N_files; i++) {
+        if (Files[i].live && (name == NULL || strcmp(Files[i].name, name) == 0)) {
+            Files[i].stale = 1;
+            if (name != NULL) {
+                return;
+            }
+        }
+    }
+    if (name != NULL && files_listed(dirfd, name, &st)) {
+        add_file(name);
+    }
+}
+
+void index_refresh(void) {
+    struct stat st;
+    int i, n = N_files;
+
+    for (i = 0; i < n; i++) {
+        struct ifile *f = &Files[i];
+        if (!f->live || !f->stale) {
+            continue;
+        }
+        f->stale = 0;
+        if (!files_listed(Dir, f->name, &st)) {
+            drop_file(i);
+        } else if (!f->indexed) {
+            index_file(i, &st);
+        } else if (st.st_ino != f->ino || files_mtime_ns(&st) != f->mtime || st.st_size != f->size) {
+            // Index it again under a new number, which keeps every
+            // posting list sorted by file
+            int id = add_file(f->name);
+            drop_file(i);
+            index_file(id, &st);
+        }
+    }
+    // Files that keep changing would otherwise leave an entry behind each time
+    if ((Dead_postings > 65536 && Dead_postings > Live_postings) || (Dead_files > 256 && Dead_files * 2 > N_files)) {
+        compact();
+    }
+}
+
+struct results {
+    char *text;
+    size_t len, cap;
+    int matches;
+};
+
+static void emit(struct results *r, const char *name, uint32_t line, const unsigned char *text, size_t len) {
+    size_t need;
+
+    while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) {
+        len--;
+    }
+    if (len > SHOW_LINE) {
+        len = SHOW_LINE;
+    }
+    need = strlen(name) + len + 16;
+    if (r->len + need > r->cap) {
+        while (r->len + need > r->cap) {
+            r->cap = r->cap ? r->cap * 2 : 4096;
+        }
+        if ((r->text = realloc(r->text, r->cap)) == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    r->len += snprintf(r->text + r->len, r->cap - r->len, "%s:%u:%.*s\n", name, line + 1, (int)len, text);
+    r->matches++;
+}
+
+static int has_posting(const struct word *wd, const struct posting *p) {
+    uint32_t lo = 0, hi = wd->n;
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        const struct posting *q = &wd->p[mid];
+        if (q->file < p->file || (q->file == p->file && q->line < p->line)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < wd->n && wd->p[lo].file == p->file && wd->p[lo].line == p->line;
+}
+
+struct scanning {
+    struct ifile *f;
+    char (*terms)[MAX_WORD + 1];
+    int n_terms;
+    unsigned int found;
+    uint32_t line;
+    struct results *r;
+};
+
+static void scan_word(void *arg, const char *w) {
+    struct scanning *x = arg;
+    int t;
+
+    for (t = 0; t < x->n_terms; t++) {
+        if (strcmp(w, x->terms[t]) == 0) {
+            x->found |= 1U << t;
+        }
+    }
+}
+
+static int scan_line(void *arg, off_t start, const unsigned char *text, size_t len) {
+    struct scanning *x = arg;
+
+    (void)start;
+    if (x->found == (1U << x->n_terms) - 1) {
+        emit(x->r, x->f->name, x->line, text, len);
+    }
+    x->found = 0;
+    x->line++;
+    return x->r->matches >= MAX_RESULTS;
+}
+
+/* Search a file that is too large for the index, line by line */
+static void scan_file(struct ifile *f, char terms[][MAX_WORD + 1], int n_terms, struct results *r) {
+    struct scanning x = {f, terms, n_terms, 0, 0, r};
+
+    walk_file(f, scan_word, scan_line, &x);
+}
+
+size_t index_grep(const char *term, char **text, int *matches) {
+    char terms[MAX_TERMS][MAX_WORD + 1];
+    const unsigned char *q = (const unsigned char *)term;
+    struct word *wd[MAX_TERMS];
+    struct results r = {NULL, 0, 0, 0};
+    int n_terms = 0, t, i, rarest = 0, cur = -1, fd = -1;
+    uint32_t j;
+    size_t start;
+
+    while (*q && n_terms < MAX_TERMS) {
+        if (!is_word_byte(*q)) {
+            q++;
+            continue;
+        }
+        for (start = 0; is_word_byte(q[start]); start++)
+            ;
+        fold_word(terms[n_terms++], q, start);
+        q += start;
+    }
+
+    // Walk the shortest posting list and look the others up in it
+    for (t = 0; t < n_terms; t++) {
+        if ((wd[t] = find_word(terms[t], 0)) == NULL) {
+            break;
+        }
+        if (wd[t]->n < wd[rarest]->n) {
+            rarest = t;
+        }
+    }
+    for (j = 0; n_terms > 0 && t == n_terms && j < wd[rarest]->n && r.matches < MAX_RESULTS; j++) {
+        const struct posting *p = &wd[rarest]->p[j];
+        struct ifile *f = &Files[p->file];
+        unsigned char line[SHOW_LINE + 2];
+        struct stat st;
+        ssize_t got;
+
+        if (!f->live) {
+            continue;
+        }
+        for (i = 0; i < n_terms; i++) {
+            if (i != rarest && !has_posting(wd[i], p)) {
+                break;
+            }
+        }
+        if (i < n_terms) {
+            continue;
+        }
+        // Only the matching lines are read back, for the text
+        if ((int)p->file != cur) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            fd = files_open(Dir, f->name, &st);
+            cur = p->file;
+        }
+        if ((got = fd >= 0 ? pread(fd, line, sizeof(line), f->lines[p->line]) : 0) < 0) {
+            got = 0;
+        }
+        unsigned char *nl = memchr(line, '\n', got);
+        emit(&r, f->name, p->line, line, nl ? nl - line : got);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    for (i = 0; n_terms > 0 && i < N_files && r.matches < MAX_RESULTS; i++) {
+        if (Files[i].live && Files[i].scanned) {
+            scan_file(&Files[i], terms, n_terms, &r);
+        }
+    }
+
+    *text = r.text;
+    *matches = r.matches;
+    return r.len;
+}
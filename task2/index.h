@@ -0,0 +1,27 @@
+#ifndef INDEX_H_
+#define INDEX_H_
+/*
+  index.h
+  In-memory inverted index of the words in the listed files, for task2 grep.
+  A word is a run of letters, digits, '_' or non-ASCII bytes, compared
+  without case. Every word maps to the (file, line) pairs it occurs on, so
+  a query touches only the postings of its words. Change notifications
+  only mark a file stale; it is indexed again at the next query.
+*/
+#include <stddef.h>
+
+/* Index the files below dirfd; nothing is read until index_refresh() */
+void index_init(int dirfd);
+
+/* name changed, appeared or went away (NULL: anything may have changed) */
+void index_changed(int dirfd, const char *name);
+
+/* Bring every stale file up to date */
+void index_refresh(void);
+
+/* Find the lines that contain all the words of term. The results, one
+   "file:line:text" per line, are put in a malloc()ed buffer; *matches is
+   their number. Returns the length of the buffer. */
+size_t index_grep(const char *term, char **text, int *matches);
+
+#endif /* INDEX_H_ */
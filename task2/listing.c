@@ -0,0 +1,191 @@
+/*
+  listing.c
+*/
+
+#include "listing.h"
+#include "files.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+struct entry {
+    char *name;
+    long long size;
+    time_t mtime;
+};
+
+static int Dir = -1;
+static int Notify = -1;
+static struct entry *Entries;   /* sorted by name */
+static int N_entries, Cap_entries;
+static void (*On_change)(int dirfd, const char *name);
+
+/* Preformatted replies, rebuilt only after a change */
+static char *Text[2];
+static size_t Text_len[2], Text_cap[2];
+static int Dirty[2] = {1, 1};
+
+/* Index of name, or -(insertion point) - 1 */
+static int find(const char *name) {
+    int lo = 0, hi = N_entries - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(Entries[mid].name, name);
+        if (c == 0) {
+            return mid;
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return -lo - 1;
+}
+
+/* Bring the entry for one name in line with the directory */
+static void refresh(const char *name) {
+    struct stat st;
+    int i = find(name);
+
+    if (!files_listed(Dir, name, &st)) {
+        if (i >= 0) {
+            free(Entries[i].name);
+            memmove(&Entries[i], &Entries[i + 1], (N_entries - i - 1) * sizeof(struct entry));
+            N_entries--;
+        }
+    } else {
+        if (i < 0) {
+            i = -i - 1;
+            if (N_entries == Cap_entries) {
+                Cap_entries = Cap_entries ? Cap_entries * 2 : 64;
+                if ((Entries = realloc(Entries, Cap_entries * sizeof(struct entry))) == NULL) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            memmove(&Entries[i + 1], &Entries[i], (N_entries - i) * sizeof(struct entry));
+            Entries[i].name = strdup(name);
+            N_entries++;
+        }
+        Entries[i].size = st.st_size;
+        Entries[i].mtime = st.st_mtime;
+    }
+    Dirty[0] = Dirty[1] = 1;
+    if (On_change) {
+        On_change(Dir, name);
+    }
+}
+
+static void scan(void) {
+    DIR *dir;
+    struct dirent *ent;
+    int i;
+
+    for (i = 0; i < N_entries; i++) {
+        free(Entries[i].name);
+    }
+    N_entries = 0;
+    Dirty[0] = Dirty[1] = 1;
+    if (On_change) {
+        On_change(Dir, NULL);
+    }
+
+    // fdopendir() takes over the descriptor, so give it a copy
+    if ((dir = fdopendir(dup(Dir))) == NULL) {
+        return;
+    }
+    rewinddir(dir);
+    while ((ent = readdir(dir)) != NULL) {
+        refresh(ent->d_name);
+    }
+    closedir(dir);
+}
+
+void listing_on_change(void (*fn)(int dirfd, const char *name)) {
+    On_change = fn;
+}
+
+int listing_init(int dirfd, const char *path) {
+    Dir = dirfd;
+#ifdef __linux__
+    if ((Notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1 &&
+        inotify_add_watch(Notify, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                          IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) == -1) {
+        perror("inotify_add_watch");
+        close(Notify);
+        Notify = -1;
+    }
+#else
+    (void)path;
+#endif
+    scan();
+    return Notify;
+}
+
+void listing_update(void) {
+#ifdef __linux__
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    char *p;
+
+    while ((len = read(Notify, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                scan(); /* events were lost: start over */
+            } else if (ev->len > 0) {
+                refresh(ev->name); /* a rename arrives as a MOVED_FROM and a MOVED_TO */
+            }
+        }
+    }
+#endif
+}
+
+static void append(int fmt, const char *line, size_t len) {
+    if (Text_len[fmt] + len > Text_cap[fmt]) {
+        while (Text_len[fmt] + len > Text_cap[fmt]) {
+            Text_cap[fmt] = Text_cap[fmt] ? Text_cap[fmt] * 2 : 4096;
+        }
+        if ((Text[fmt] = realloc(Text[fmt], Text_cap[fmt])) == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(Text[fmt] + Text_len[fmt], line, len);
+    Text_len[fmt] += len;
+}
+
+const char *listing_get(int longfmt, size_t *len) {
+    char line[1024], when[32];
+    int fmt = longfmt ? 1 : 0, i, l;
+
+    // Without change notifications nothing tells us the cache is stale
+    if (Notify == -1) {
+        scan();
+    }
+    if (Dirty[fmt]) {
+        Text_len[fmt] = 0;
+        for (i = 0; i < N_entries; i++) {
+            if (longfmt) {
+                strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&Entries[i].mtime));
+                l = snprintf(line, sizeof(line), "%-24s %12lld  %s\n", Entries[i].name, Entries[i].size, when);
+            } else {
+                l = snprintf(line, sizeof(line), "%s\n", Entries[i].name);
+            }
+            append(fmt, line, l < (int)sizeof(line) ? l : (int)sizeof(line) - 1);
+        }
+        Dirty[fmt] = 0;
+    }
+    *len = Text_len[fmt];
+    return Text[fmt] ? Text[fmt] : "";
+}
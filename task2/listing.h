@@ -0,0 +1,29 @@
+#ifndef LISTING_H_
+#define LISTING_H_
+/*
+  listing.h
+  Cached listing of the *.txt files in the work directory.
+  The entries (name, size, mtime) are kept sorted and updated one file at
+  a time from inotify events, and both reply formats are kept preformatted,
+  so `list` is a single copy of a ready buffer.
+*/
+#include <stddef.h>
+
+/* Call fn for every name that may have changed (NULL: any name may have).
+   Set before listing_init() to hear about the files found at startup. */
+void listing_on_change(void (*fn)(int dirfd, const char *name));
+
+/* Scan the work directory (dirfd, opened from path) and start watching it.
+   Returns a descriptor to poll for POLLIN, or -1 when changes cannot be
+   watched (the listing is then rebuilt on every request). */
+int listing_init(int dirfd, const char *path);
+
+/* Apply the pending change notifications. Call when the descriptor from
+   listing_init() is readable. */
+void listing_update(void);
+
+/* The listing: one name per line, or with longfmt "name size mtime" lines.
+   The buffer stays valid until the next listing_*() call. */
+const char *listing_get(int longfmt, size_t *len);
+
+#endif /* LISTING_H_ */
@@ -0,0 +1,111 @@
+/*
+
+    --- コンパイルコマンド ---
+    gcc -O2 -o sumbench sumbench.c checksum.c
+    または、makefileを使用して make コマンドによるコンパイル
+
+    --- 実行例 ---
+
+    ./sumbench -s 65536 -n 20000
+    ./sumbench -s 268435456 -n 10
+
+    Throughput of the checksum kernels behind the task2 sum command. Hashes
+    a buffer of <size> random bytes <rounds> times with every kernel this
+    machine can run, checks that they all give the same value, and prints
+    GB/s for each. A small buffer measures the kernel from the CPU cache, a
+    large one the memory bandwidth it can keep up with.
+
+*/
+
+#include "checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define DEFAULT_SIZE (1 << 20)
+#define DEFAULT_ROUNDS 1000
+
+static double now_sec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void print_usage(char *program_name) {
+    fprintf(stderr, "Usage: %s [-s size] [-n rounds]\n", program_name);
+}
+
+int main(int argc, char *argv[]) {
+    static const char *names[] = {"scalar", "sse2", "avx2", "neon"};
+    size_t size = DEFAULT_SIZE, i;
+    long rounds = DEFAULT_ROUNDS, r;
+    unsigned char *buf;
+    uint64_t sum, first = 0;
+    int c, k, mismatch = 0, tried = 0;
+
+    while ((c = getopt(argc, argv, "s:n:h")) != -1) {
+        switch (c) {
+        case 's':
+            size = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            rounds = atol(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (size == 0 || rounds <= 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((buf = malloc(size)) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    srandom(1);
+    for (i = 0; i < size; i++) {
+        buf[i] = random();
+    }
+
+    for (k = 0; k < (int)(sizeof(names) / sizeof(names[0])); k++) {
+        if (checksum_set_kernel(names[k]) == -1) {
+            continue;
+        }
+        sum = checksum(buf, size); /* warm up */
+        double begin = now_sec();
+        for (r = 0; r < rounds; r++) {
+            sum ^= checksum(buf, size);
+        }
+        double elapsed = now_sec() - begin;
+        sum = checksum(buf, size);
+        if (tried++ == 0) {
+            first = sum;
+        } else if (sum != first) {
+            mismatch = 1;
+        }
+        printf("%-7s %016llx  %8.2f GB/s\n", names[k], (unsigned long long)sum,
+               (double)size * rounds / elapsed / 1e9);
+    }
+
+    // Every kernel must agree on every length, including the partial stripe
+    for (i = 0; i < 300 && i <= size; i++) {
+        uint64_t ref;
+        checksum_set_kernel("scalar");
+        ref = checksum(buf, i);
+        for (k = 1; k < (int)(sizeof(names) / sizeof(names[0])); k++) {
+            if (checksum_set_kernel(names[k]) == 0 && checksum(buf, i) != ref) {
+                mismatch = 1;
+            }
+        }
+    }
+    if (mismatch) {
+        fprintf(stderr, "kernels disagree\n");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
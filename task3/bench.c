@@ -0,0 +1,282 @@
+/*
+
+    --- コンパイルコマンド ---
+    gcc -I../mynet -L../mynet -o bench bench.c -lmynet
+    または、makefileを使用して make コマンドによるコンパイル
+
+    --- 実行例 ---
+
+    ./task3 50000 1 16 > /dev/null &
+    ./bench -c 1000 -d 4 localhost 50000
+
+    実行結果:
+    clients 1000, 4.0 sec: 59681 sessions (14918 sessions/sec), 0 errors
+    latency: p50 0.410 ms, p99 1046.990 ms, max 3698.397 ms
+
+    Load generator for the task3 echo server. It keeps <clients> connections
+    busy at the same time; each one connects, sends a newline-terminated
+    message, waits for the whole echo and reconnects, which is exactly one
+    echo() session on the server. Latency is measured from connect() to the
+    last echoed byte.
+
+    With -l, the message is <bytes> long (one newline at the end), which
+    measures per-connection echo throughput rather than session rate.
+
+    With -a, the load generator pins itself to <cpu>, so it does not compete
+    with server workers pinned by task3 -a.
+
+    With -p, each client sends the first half of the message, waits
+    <pause_ms> and then sends the rest, so sessions stay open like a slow
+    interactive user and the server has to hold many of them at once.
+
+*/
+
+#include "mynet.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+
+#define DEFAULT_CLIENTS 10
+#define DEFAULT_SECONDS 5
+#define DEFAULT_MESSAGE "hello, task3 echo server\n"
+#define MSGSIZE 256
+#define RECVSIZE 65536
+
+struct client {
+    int sock;
+    int sent;           /* bytes of the message sent so far */
+    int received;       /* bytes of the echo received so far */
+    double start;       /* when this session's connect() was issued */
+    double resume;      /* when to send the second half (with -p) */
+};
+
+static struct sockaddr_in server_adrs;
+static char *message;
+static int message_len;
+static int split_len;       /* bytes sent before the pause */
+static double pause_sec;
+
+static double *latency;     /* per-session latency in seconds */
+static long n_latency, latency_cap;
+static long n_errors;
+
+static double now_sec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void record_latency(double sec) {
+    if (n_latency == latency_cap) {
+        latency_cap = latency_cap ? latency_cap * 2 : 4096;
+        if ((latency = realloc(latency, latency_cap * sizeof(double))) == NULL) {
+            exit_errmesg("realloc()");
+        }
+    }
+    latency[n_latency++] = sec;
+}
+
+static void start_session(struct client *c) {
+    if ((c->sock = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+        exit_errmesg("socket()");
+    }
+    fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL, 0) | O_NONBLOCK);
+    c->sent = c->received = 0;
+    c->start = now_sec();
+    c->resume = 0;
+    if (connect(c->sock, (struct sockaddr *)&server_adrs, sizeof(server_adrs)) == -1 &&
+        errno != EINPROGRESS) {
+        perror("connect()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void end_session(struct client *c, int ok) {
+    if (ok) {
+        record_latency(now_sec() - c->start);
+    } else {
+        n_errors++;
+    }
+    close(c->sock);
+}
+
+/* Bytes the client may send right now */
+static int sendable(struct client *c, double now) {
+    if (c->sent < split_len) {
+        return split_len - c->sent;
+    }
+    if (c->sent < message_len && now >= c->resume) {
+        return message_len - c->sent;
+    }
+    return 0;
+}
+
+/* Move one session forward. Returns 1 when it has finished. */
+static int step(struct client *c, short revents) {
+    static char buf[RECVSIZE];
+    int r, n;
+
+    if (revents & (POLLERR | POLLNVAL)) {
+        end_session(c, 0);
+        return 1;
+    }
+    if ((revents & POLLOUT) && (n = sendable(c, now_sec())) > 0) {
+        r = send(c->sock, message + c->sent, n, 0);
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EINPROGRESS) {
+                return 0;
+            }
+            end_session(c, 0);
+            return 1;
+        }
+        c->sent += r;
+        if (c->sent == split_len) {
+            c->resume = now_sec() + pause_sec;
+        }
+    }
+    if (revents & (POLLIN | POLLHUP)) {
+        r = recv(c->sock, buf, sizeof(buf), 0);
+        if (r == -1 && errno == EAGAIN) {
+            return 0;
+        }
+        if (r <= 0) {
+            end_session(c, 0);
+            return 1;
+        }
+        c->received += r;
+        if (c->received >= message_len) {
+            end_session(c, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double p) {
+    long i = (long)(p * (n_latency - 1));
+    return n_latency ? latency[i] * 1000 : 0;
+}
+
+static void print_usage(char *program_name) {
+    fprintf(stderr, "Usage: %s [-c clients] [-d seconds] [-m message | -l bytes] [-p pause_ms] [-a cpu] <server> <port_number>\n", program_name);
+}
+
+int main(int argc, char *argv[]) {
+    int n_clients = DEFAULT_CLIENTS;
+    double seconds = DEFAULT_SECONDS;
+    struct client *clients;
+    struct pollfd *pfd;
+    struct rlimit rl;
+    int c, i, cpu = -1;
+
+    if ((message = malloc(MSGSIZE)) == NULL) {
+        exit_errmesg("malloc()");
+    }
+    snprintf(message, MSGSIZE, "%s", DEFAULT_MESSAGE);
+    message_len = strlen(message);
+    while ((c = getopt(argc, argv, "c:d:m:l:p:a:h")) != -1) {
+        switch (c) {
+        case 'c':
+            n_clients = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        case 'm':
+            // The server ends a session at a newline, so always send one.
+            // An earlier -l may have left a smaller buffer: the last option wins
+            if ((message = realloc(message, MSGSIZE)) == NULL) {
+                exit_errmesg("realloc()");
+            }
+            snprintf(message, MSGSIZE - 1, "%s", optarg);
+            strcat(message, "\n");
+            message_len = strlen(message);
+            break;
+        case 'l':
+            // A large payload with a single newline at the end
+            if ((message_len = atoi(optarg)) < 1 || (message = realloc(message, message_len)) == NULL) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            memset(message, 'x', message_len - 1);
+            message[message_len - 1] = '\n';
+            break;
+        case 'p':
+            pause_sec = atof(optarg) / 1000;
+            break;
+        case 'a':
+            cpu = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 2 || n_clients <= 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    split_len = pause_sec > 0 ? message_len / 2 : message_len;
+    set_sockaddr_in(&server_adrs, argv[optind], atoi(argv[optind + 1]));
+
+    // Keep the load generator off the CPUs the server workers are pinned to
+    if (cpu >= 0 && pin_cpu(cpu) == -1) {
+        perror("pin_cpu()");
+    }
+
+    // Thousands of concurrent clients need as many descriptors
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if ((clients = malloc(n_clients * sizeof(struct client))) == NULL ||
+        (pfd = malloc(n_clients * sizeof(struct pollfd))) == NULL) {
+        exit_errmesg("malloc()");
+    }
+    for (i = 0; i < n_clients; i++) {
+        start_session(&clients[i]);
+    }
+
+    double begin = now_sec(), end = begin + seconds;
+    while (now_sec() < end) {
+        double now = now_sec();
+        for (i = 0; i < n_clients; i++) {
+            pfd[i].fd = clients[i].sock;
+            pfd[i].events = POLLIN | (sendable(&clients[i], now) > 0 ? POLLOUT : 0);
+        }
+        // Wake up regularly to send the second halves that are due
+        if (poll(pfd, n_clients, pause_sec > 0 ? 5 : 100) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            exit_errmesg("poll()");
+        }
+        now = now_sec();
+        for (i = 0; i < n_clients; i++) {
+            if (pfd[i].revents == 0 && clients[i].sent == split_len && sendable(&clients[i], now) > 0) {
+                pfd[i].revents = POLLOUT; /* the pause is over */
+            }
+            if (pfd[i].revents && step(&clients[i], pfd[i].revents)) {
+                start_session(&clients[i]);
+            }
+        }
+    }
+    double elapsed = now_sec() - begin;
+
+    qsort(latency, n_latency, sizeof(double), compare_double);
+    printf("clients %d, %.1f sec: %ld sessions (%.0f sessions/sec), %ld errors\n",
+           n_clients, elapsed, n_latency, n_latency / elapsed, n_errors);
+    printf("latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           percentile(0.50), percentile(0.99), percentile(1.0));
+    printf("throughput: %.1f MB/s echoed\n", (double)n_latency * message_len / elapsed / 1e6);
+
+    return 0;
+}
@@ -0,0 +1,110 @@
+/*
+
+    --- コンパイルコマンド ---
+    gcc -I../mynet -L../mynet -o sbview sbview.c -lmynet
+    または、makefileを使用して make コマンドによるコンパイル
+
+    --- 実行例 ---
+
+    ./task3 -S /tmp/task3.sb 50000 0 4 > /dev/null &
+    ./bench -c 3 -d 3 -p 500 localhost 50000 &
+    ./sbview -n 1 /tmp/task3.sb
+
+    実行結果:
+    up 1.8 s: 4 workers, 3 busy, 6 requests (3.3/s), 186 bytes (103 B/s)
+    slot    pid  state      for  requests     bytes  peer
+       0  13398  busy     0.5 s         2        62  127.0.0.1:56942
+       1  13399  busy     0.5 s         2        62  127.0.0.1:56948
+       2  13400  idle     0.5 s         2        50
+       3  13401  busy     0.5 s         0        12  127.0.0.1:56940
+
+    Live viewer for the worker scoreboard of task3 (-S) and tcp_echo/echofork
+    (-S). It maps the scoreboard file read-only and samples it every
+    <interval_ms>, so the workers never wait for it. Rates are per second
+    since the previous sample (since start-up for the first one).
+
+*/
+
+#include "mynet.h"
+
+#define DEFAULT_INTERVAL_MS 1000
+
+static void print_usage(char *program_name) {
+    fprintf(stderr, "Usage: %s [-i interval_ms] [-n samples] <scoreboard>\n", program_name);
+}
+
+int main(int argc, char *argv[]) {
+    int interval_ms = DEFAULT_INTERVAL_MS;
+    int samples = 0;    /* 0: until interrupted */
+    sb_board *board;
+    sb_slot s;
+    uint64_t now, prev_time, prev_requests = 0, prev_bytes = 0;
+    uint64_t requests, bytes;
+    int c, i, workers, busy;
+
+    while ((c = getopt(argc, argv, "i:n:h")) != -1) {
+        switch (c) {
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 'n':
+            samples = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 1) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if ((board = sb_attach(argv[optind])) == NULL) {
+        fprintf(stderr, "%s: not a scoreboard\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    prev_time = board->started;
+    for (;;) {
+        now = sb_now();
+        requests = bytes = 0;
+        workers = busy = 0;
+        for (i = 0; i < board->n_slots; i++) {
+            sb_read(&board->slot[i], &s);
+            requests += s.requests;
+            bytes += s.bytes;
+            if (s.state != SB_EMPTY) {
+                workers++;
+                busy += s.state == SB_BUSY;
+            }
+        }
+
+        double elapsed = (now - prev_time) / 1000.0;
+        printf("up %.1f s: %d workers, %d busy, %llu requests (%.1f/s), %llu bytes (%.0f B/s)\n",
+               (now - board->started) / 1000.0, workers, busy,
+               (unsigned long long)requests, elapsed > 0 ? (requests - prev_requests) / elapsed : 0,
+               (unsigned long long)bytes, elapsed > 0 ? (bytes - prev_bytes) / elapsed : 0);
+        printf("slot    pid  state      for  requests     bytes  peer\n");
+        for (i = 0; i < board->n_slots; i++) {
+            sb_read(&board->slot[i], &s);
+            if (s.state == SB_EMPTY && s.requests == 0) {
+                continue;
+            }
+            printf("%4d %6d  %-5s %6.1f s %9llu %9llu  %s\n", i, s.pid, sb_state_name(s.state),
+                   (now - s.since) / 1000.0, (unsigned long long)s.requests,
+                   (unsigned long long)s.bytes, s.state == SB_BUSY ? s.peer : "");
+        }
+        fflush(stdout);
+
+        prev_time = now;
+        prev_requests = requests;
+        prev_bytes = bytes;
+        if (samples > 0 && --samples == 0) {
+            break;
+        }
+        usleep(interval_ms * 1000);
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -34,22 +34,129 @@
     Client is accepted [pid = 72423, thread_id = 3]
     Client is accepted [pid = 72423, thread_id = 4]
 
-    --- 実行例3 (argument error) ---
+    --- 実行例３ (プロセス×スレッド) ---
+
+    サーバーコマンド:
+    ./task3 -t 4 50000 2 2
+
+    2つのプロセスがそれぞれSO_REUSEPORTで自分のリスニングソケットを持ち、
+    各プロセスの4つのスレッドがpollで多数の接続を同時に処理する。
+    カーネルが接続をプロセスに振り分けるので、1つのaccept()に全員が並ぶことはない。
+
+    ベンチマーク (10/1000/10000 クライアントで3つのモードを比較する):
+    ./bench -c 1000 -d 4 -p 100 localhost 50000
+
+    -p 100 で各クライアントがメッセージの途中で100ミリ秒止まるときの結果
+    (ループバック、1 CPU、モード0/1は16ワーカー、モード2は2プロセス×2スレッド、sessions/sec):
+
+                    10      1000    10000
+    0 (fork)        87      178     195
+    1 (thread)      78      202     199
+    2 (hybrid)      95      2387    4311
+
+    モード0/1は同時に処理できるセッションがワーカー数に限られるが、
+    モード2はクライアントが止まっている間も他の接続を処理できる。
+
+    --- 実行例４ (無停止入れ替え) ---
+
+    サーバーコマンド:
+    ./task3 -U /tmp/task3.sock 50000 1 5
+    ./task3 -U /tmp/task3.sock 50000 1 5    # 新しいバイナリで
+
+    同じ -U のパスで新しいバイナリを起動すると、古いプロセスからリスニングソケットを
+    SCM_RIGHTSで受け取る。古いプロセスは受け付けをやめ、処理中の接続を終えてから終了する。
+    リスニングソケットは共有されるので、待ち行列にある接続も失われない。
+    モードを変えて入れ替えることもできる。モード0/1からモード2へは、受け取った
+    リスニングソケットを全プロセスで共有し、モード2からモード0/1へは、古いプロセスの
+    SO_REUSEPORTのグループに加わって待ち受ける。
+
+    --- 実行例5 (伸縮するワーカープール) ---
+
+    サーバーコマンド:
+    ./task3 -M 32 -i 2 -b 128 50000 0 4
+
+    4ワーカーで起動し、supervisorが200ミリ秒ごとにacceptキューの長さ
+    (LinuxのTCP_INFO) と処理中のワーカー数を見て、32ワーカーまで増やす。
+    負荷がワーカー数より2以上少ない状態が -i 秒続くと、いちばん長く
+    暇なワーカーから処理中のセッションを終えたあとで退役させる。
+
+    実行結果 (./bench -c 20 -p 100 localhost 50000 を3秒流して止めたとき):
+    [supervisor] 4 workers (min 4, max 32, backlog 128, cooldown 2s)
+    [supervisor] spawn worker 4 (queued, busy 4/4, queued 16) -> 5 workers
+    ...
+    [supervisor] spawn worker 19 (queued, busy 4/4, queued 16) -> 20 workers
+    [supervisor] spawn worker 20 (all busy, busy 20/20, queued 0) -> 21 workers
+    [supervisor] retire worker 0 (idle 2s, busy 0/21, queued 0) -> 20 workers
+    ...
+    [supervisor] retire worker 16 (idle 5s, busy 0/5, queued 0) -> 4 workers
+
+    --- 実行例6 (spliceによるエコー) ---
+
+    サーバーコマンド:
+    ./task3 -s 50000 1 4
+
+    受信したデータをパイプ経由でspliceし、ユーザ空間にコピーせずに同じソケットへ
+    送り返す。1回に運ぶ量はパイプ容量 (最大1MB) で、改行で終わるまでがセッションになる。
+
+    ./bench -c 1 -d 2 -l 16000000 localhost 50000 (1接続、16MBのメッセージ):
+    コピー (50バイトのバッファ)   32 MB/s
+    splice                      1320 MB/s
+
+    --- 実行例7 (CPUへの固定) ---
+
+    サーバーコマンド:
+    ./task3 -a worker -b 128 50000 1 2      # ワーカーnをCPU nに固定する
+    ./task3 -a incoming -b 128 50000 2 4    # プロセスpはCPU pを受け持つ
+
+    -a worker ではワーカー (タイプ2ではプロセスpのスレッドi) を順にCPUへ固定する。
+    -a incoming では、タイプ0/1のワーカーは受け付けた接続のSO_INCOMING_CPUへ移り、
+    タイプ2の各プロセスは自分のリスニングソケットにSO_INCOMING_CPUを設定して、
+    そのCPUで受けたパケットの接続をカーネルから優先して受け取る。
+    ワーカーのバッファはCPUに固定してから自分で書き込んで確保するので (first touch)、
+    そのCPUのNUMAノードに置かれる。
+
+    ./bench -c 50 -d 2 localhost 50000 の p99 (1 CPUの環境なので固定の効果はほぼ出ない):
+
+                    なし      worker    incoming
+    1 (thread)      4.5 ms    5.0 ms    4.9 ms
+    2 (hybrid)      5.7 ms    5.0 ms    5.1 ms
+
+    複数CPUの環境では bench -a <cpu> で負荷生成側をワーカーのいないCPUに固定して比べる。
+
+    --- 実行例8 (argument error) ---
 
     サーバーコマンド:
     ./task3
 
     実行結果:
-    Usage: ./task3 <port_number> <parallel_type> <connection_limit>
+    Usage: ./task3 [-U upgrade_path] [-t threads] [-b backlog] [-M max_workers] [-i cooldown] [-s]
+           [-a worker|incoming] [-S scoreboard] <port_number> <parallel_type> <connection_limit>
 
     Options:
+    -t threads          Event-loop threads per process for parallel_type 2 (default 4).
+    -b backlog          Listen backlog (default 5).
+    -M max_workers      Let parallel_type 0/1 grow up to max_workers workers while
+                        connections queue up (default: connection_limit, a fixed pool).
+    -i cooldown         Seconds of low load before idle workers are retired (default 10).
+    -s                  parallel_type 0/1: echo with splice() through a pipe instead
+                        of copying through a 50-byte buffer.
+    -a worker           Pin worker n (thread n of process p in type 2) to a CPU.
+    -a incoming         Follow SO_INCOMING_CPU: types 0/1 move a worker to the CPU
+                        that received its connection; in type 2 process p owns CPU p.
+    -S scoreboard       File backing the worker scoreboard (parallel_type 0/1),
+                        so ./sbview can watch it live.
+    -U upgrade_path     Unix socket path for hot upgrades. A new binary started
+                        with the same path takes over the listening socket.
     <port_number>       Specifies the port number the server will listen on.
                         This should be a value between 1024 and 65535.
     <parallel_type>     Indicates the type of parallel processing to use:
                         0 - Process-based parallelism (using fork)
                         1 - Thread-based parallelism (using pthreads)
-    <connection_limit>  The maximum number of concurrent connections
-                        that the server will handle at one time.
+                        2 - Processes with SO_REUSEPORT listeners, each running
+                            event-loop threads that multiplex many connections
+    <connection_limit>  The number of workers started up front, which is also
+                        the minimum the pool shrinks back to.
+                        For parallel_type 2, the number of processes.
 
     Example:
     ./task3 8080 1 5     # Starts the server on port 8080 with thread-based parallelism
@@ -63,76 +170,216 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <netinet/tcp.h>
 
 #define BUFSIZE 50
+#define MAX_WORKERS 1024
+#define DEFAULT_THREADS 4
+#define DEFAULT_BACKLOG 5
+#define DEFAULT_COOLDOWN 10 /* seconds the pool must stay calm before shrinking */
+#define DRAIN_POLL_MS 200   /* how often event loops look at the drain flag */
+#define SUPERVISE_MS 200    /* how often the supervisor samples the pool */
+
+#define AFFINITY_NONE 0     /* let the scheduler place workers */
+#define AFFINITY_WORKER 1   /* pin worker n to CPU n */
+#define AFFINITY_INCOMING 2 /* follow the CPU that received the connection */
+
+/* One connection multiplexed by an event-loop thread */
+struct conn {
+    int sock;
+    int len;            /* bytes received and not yet echoed back */
+    int off;            /* bytes of buf already sent */
+    char buf[BUFSIZE];
+};
 
 struct thread_args {
     int sock;
     int thread_id;
+    int cpu;            /* CPU to pin the thread to, or -1 */
+};
+
+// Control flags for one worker slot. The array lives in a MAP_SHARED
+// mapping so forked workers see the same copy as threads do. What the
+// worker is doing is published on the scoreboard instead.
+struct worker_state {
+    atomic_int retire;      /* exit after the current session */
+    atomic_int exited;      /* thread mode: ready to be joined */
 };
 
-void echo(int sock_listen);
+void echo(int sock_listen, int slot);
 void *echo_thread(void *arg);
 void clean_exit(char *message);
 void signal_handler(int sig);
 void print_usage(char *program_name);
+void drain_handler(int sig);
+void hand_off(void);
+void take_over(int conn);
+void drain_workers(int parallel_type, int n);
+void supervise(int parallel_type, int min_workers, int max_workers, int cooldown);
+void event_process(int port_number, int n_threads, int proc);
+void *event_loop(void *arg);
+static int init_reuseport_server(int port_number);
 
 int sock_listen;
-int thread_id = 0;
+int backlog = DEFAULT_BACKLOG;
+int use_splice = 0;                 /* echo through a pipe with splice() */
+int affinity = AFFINITY_NONE;
+
+char *upgrade_path = NULL;          /* Unix socket path used for hot upgrades */
+int sock_handoff = -1;              /* waits for a new binary to take over */
+volatile sig_atomic_t draining = 0; /* parallel_type 2: stop accepting, finish open sessions */
+struct worker_state *board;         /* MAX_WORKERS entries shared with the workers */
+sb_board *scoreboard;               /* per-worker state and counters, one slot per worker */
+char *scoreboard_path = NULL;       /* file backing the scoreboard so sbview can attach */
+int worker_alive[MAX_WORKERS];      /* slot holds a worker that has not been reaped */
+pid_t worker_pid[MAX_WORKERS];
+pthread_t worker_tid[MAX_WORKERS];
 
 int main(int argc, char *argv[]) {
     int port_number;
     int parallel_type;
     int connection_limit;
     pid_t child;
-    struct thread_args *args;
-    pthread_t tid;
-    int i;
+    struct sigaction sa;
+    int i, c, conn;
+    int n_threads = DEFAULT_THREADS;
+    int max_workers = 0;
+    int cooldown = DEFAULT_COOLDOWN;
+
+    while ((c = getopt(argc, argv, "U:t:b:M:i:sa:S:")) != -1) {
+        switch (c) {
+        case 'U':
+            upgrade_path = optarg;
+            break;
+        case 't':
+            // Every process needs at least one event-loop thread to serve
+            if ((n_threads = atoi(optarg)) < 1) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'M':
+            max_workers = atoi(optarg);
+            break;
+        case 'i':
+            cooldown = atoi(optarg);
+            break;
+        case 's':
+            use_splice = 1;
+            break;
+        case 'S':
+            scoreboard_path = optarg;
+            break;
+        case 'a':
+            if (strcmp(optarg, "worker") == 0) {
+                affinity = AFFINITY_WORKER;
+            } else if (strcmp(optarg, "incoming") == 0) {
+                affinity = AFFINITY_INCOMING;
+            } else {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    if (argc != 4) {
+    if (argc - optind != 3) {
         print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
     signal(SIGINT, signal_handler);
 
-    port_number = atoi(argv[1]);
-    parallel_type = atoi(argv[2]);
-    connection_limit = atoi(argv[3]);
+    // No SA_RESTART, so a blocked accept() returns EINTR and sees the drain flag
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = drain_handler;
+    sigaction(SIGUSR2, &sa, NULL);
+
+    port_number = atoi(argv[optind]);
+    parallel_type = atoi(argv[optind + 1]);
+    connection_limit = atoi(argv[optind + 2]);
+    if (connection_limit > MAX_WORKERS) {
+        connection_limit = MAX_WORKERS;
+    }
+    if (connection_limit < 1) {
+        connection_limit = 1;
+    }
+    // Without -M the pool keeps exactly connection_limit workers
+    if (max_workers < connection_limit) {
+        max_workers = connection_limit;
+    }
+    if (max_workers > MAX_WORKERS) {
+        max_workers = MAX_WORKERS;
+    }
+
+    board = mmap(NULL, MAX_WORKERS * sizeof(struct worker_state), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (board == MAP_FAILED) {
+        clean_exit("mmap failed");
+    }
+    if ((scoreboard = sb_create(scoreboard_path, max_workers)) == NULL) {
+        clean_exit("Scoreboard creation failed");
+    }
 
-    sock_listen = init_tcpserver(port_number,5 );
-    if (sock_listen < 0) {
+    if (upgrade_path != NULL && (conn = handoff_connect(upgrade_path)) != -1) {
+        // An old process is running: take over its listening socket
+        take_over(conn);
+        close(conn);
+        if (parallel_type != 2) {
+            // A parallel_type 2 process may have no shared listener to give:
+            // join the SO_REUSEPORT group of its processes while they drain
+            if (sock_listen < 0) {
+                sock_listen = init_reuseport_server(port_number);
+            }
+            // The workers block in accept(); type 2 leaves the listener nonblocking
+            fcntl(sock_listen, F_SETFL, fcntl(sock_listen, F_GETFL, 0) & ~O_NONBLOCK);
+        }
+    } else if (parallel_type == 2) {
+        // Every worker process opens its own listener
+        sock_listen = -1;
+    } else {
+        sock_listen = init_tcpserver(port_number, backlog);
+    }
+    if (parallel_type != 2 && sock_listen < 0) {
         clean_exit("Failed to initialize TCP server");
     }
+    if (upgrade_path != NULL) {
+        sock_handoff = handoff_server(upgrade_path);
+    }
 
-    if (parallel_type == 0) {
+    if (parallel_type == 0 || parallel_type == 1) {
+        supervise(parallel_type, connection_limit, max_workers, cooldown);
+    } else if (parallel_type == 2) {
+        fflush(stdout); /* or every child would print the log again */
         for (i = 0; i < connection_limit; i++) {
             child = fork();
             if (child < 0) {
                 clean_exit("Fork failed");
             } else if (child == 0) {
-                // Child process
-                echo(sock_listen);
+                event_process(port_number, n_threads, i);
                 exit(EXIT_SUCCESS);
             }
+            worker_pid[i] = child;
+            worker_alive[i] = 1;
         }
-        // Parent process
-        close(sock_listen);
-        while (wait(NULL) > 0);
-    } else if (parallel_type == 1) {
-        for (i = 0; i < connection_limit; i++) {
-            args = (struct thread_args *) malloc(sizeof(struct thread_args));
-            if (args == NULL) {
-                clean_exit("Memory allocation failed");
-            }
-            args->sock = sock_listen;
-            args->thread_id = i;
-
-            if (pthread_create(&tid, NULL, echo_thread, (void *) args) != 0) {
-                clean_exit("Thread creation failed");
-            }
+        if (sock_handoff != -1) {
+            hand_off();
+            drain_workers(0, connection_limit);
+            exit(EXIT_SUCCESS);
         }
-        pthread_exit(NULL);
+        while (wait(NULL) > 0);
     }
 
     return 0;
@@ -141,53 +388,519 @@ int main(int argc, char *argv[]) {
 void *echo_thread(void *arg) {
     struct thread_args *args = (struct thread_args *) arg;
     int sock_listen = args->sock;
+    int slot = args->thread_id;
     free(arg);
 
-    pthread_detach(pthread_self());
-
-    echo(sock_listen);
+    // Workers stay joinable so the supervisor can reap them
+    echo(sock_listen, slot);
+    board[slot].exited = 1;
 
     return NULL;
 }
 
-void echo(int sock_listen) {
+void echo(int sock_listen, int slot) {
+    struct worker_state *me = &board[slot];
+    sb_slot *sb = &scoreboard->slot[slot];
     int sock_accepted;
-    char buf[BUFSIZE];
-    int strsize;
-    int this_thread_id = thread_id++;
+    char *buf;
+    int strsize, cpu;
+    long echoed;
+    echo_pipe ep;
+
+    // Pin first so the buffers below are placed on this CPU's NUMA node
+    if (affinity == AFFINITY_WORKER) {
+        pin_cpu(slot);
+    }
+    if ((buf = alloc_local(BUFSIZE)) == NULL) {
+        clean_exit("Buffer allocation failed");
+    }
+    if (use_splice && echo_pipe_init(&ep) == -1) {
+        clean_exit("Pipe creation failed");
+    }
+    sb_start(sb, getpid());
 
-    for (;;) {
+    while (!me->retire) {
         sock_accepted = accept(sock_listen, NULL, NULL);
         if (sock_accepted < 0) {
-            perror("Accept failed");
+            if (errno != EINTR) {
+                perror("Accept failed");
+            }
             continue;
         }
-        printf("Client is accepted [pid = %d, thread_id = %d]\n", getpid(), this_thread_id);
-        do {
-            if ((strsize = recv(sock_accepted, buf, BUFSIZE, 0)) == -1) {
-                perror("Receive failed");
-                break;
+        sb_begin(sb, sock_accepted);
+        // Run the session where the kernel handled the connection's packets
+        if (affinity == AFFINITY_INCOMING && (cpu = incoming_cpu(sock_accepted)) >= 0) {
+            pin_cpu(cpu);
+        }
+        printf("Client is accepted [pid = %d, thread_id = %d]\n", getpid(), slot);
+        // A drain request only interrupts the session; it is finished before exiting
+        if (use_splice) {
+            if ((echoed = splice_echo(&ep, sock_accepted)) == -1) {
+                perror("Splice echo failed");
+            } else {
+                sb_add(sb, echoed);
             }
+        } else {
+            do {
+                while ((strsize = recv(sock_accepted, buf, BUFSIZE, 0)) == -1 && errno == EINTR);
+                if (strsize <= 0) {
+                    if (strsize == -1) {
+                        perror("Receive failed");
+                    }
+                    break;
+                }
+
+                int r;
+                while ((r = send(sock_accepted, buf, strsize, 0)) == -1 && errno == EINTR);
+                if (r == -1) {
+                    perror("Send failed");
+                    break;
+                }
+                sb_add(sb, r);
+            } while (buf[strsize - 1] != '\n');
+        }
+        close(sock_accepted);
+        sb_end(sb);
+    }
+    if (use_splice) {
+        echo_pipe_close(&ep);
+    }
+    free_local(buf, BUFSIZE);
+    sb_exit(sb);
+}
 
-            if (send(sock_accepted, buf, strsize, 0) == -1) {
-                perror("Send failed");
-                break;
+// Hand the listening socket to the new binary that connected to the upgrade path
+void hand_off(void) {
+    int conn, kind = 0;
+
+    while ((conn = accept(sock_handoff, NULL, NULL)) == -1) {
+        if (errno != EINTR) {
+            clean_exit("Accept failed");
+        }
+    }
+    if (handoff_send(conn, sock_listen, &kind, sizeof(kind)) == -1) {
+        clean_exit("Handoff failed");
+    }
+    close(conn);
+    close(sock_handoff);
+    printf("Listening socket handed off, draining [pid = %d]\n", getpid());
+}
+
+void take_over(int conn) {
+    int kind;
+
+    // parallel_type 2 has no shared listener, so the old process sends none
+    if (handoff_recv(conn, &sock_listen, &kind, sizeof(kind)) != sizeof(kind)) {
+        fprintf(stderr, "Hot upgrade failed: no listening socket received\n");
+        exit(EXIT_FAILURE);
+    }
+    if (sock_listen >= 0) {
+        printf("Took over the listening socket [pid = %d]\n", getpid());
+    }
+}
+
+// Listener owned by one worker process. With SO_REUSEPORT every process
+// binds the same port and the kernel spreads incoming connections over them.
+static int init_reuseport_server(int port_number) {
+    struct sockaddr_in my_adrs;
+    int sock, on = 1;
+
+    if ((sock = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+        exit_errmesg("socket()");
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+
+    memset(&my_adrs, 0, sizeof(my_adrs));
+    my_adrs.sin_family = AF_INET;
+    my_adrs.sin_port = htons(port_number);
+    my_adrs.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr *)&my_adrs, sizeof(my_adrs)) == -1) {
+        exit_errmesg("bind()");
+    }
+    if (listen(sock, backlog) == -1) {
+        exit_errmesg("listen()");
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    return sock;
+}
+
+// Body of a parallel_type 2 worker process. proc numbers the process;
+// with -a incoming it owns CPU proc and its listener asks the kernel for
+// the connections whose packets arrive on that CPU.
+void event_process(int port_number, int n_threads, int proc) {
+    pthread_t *tids;
+    struct thread_args *args;
+    int i;
+
+    if (sock_handoff != -1) {
+        close(sock_handoff);
+    }
+    if (sock_listen >= 0) {
+        // Taken over from a parallel_type 0/1 process: its listener holds the
+        // port without SO_REUSEPORT, so every process shares it instead
+        fcntl(sock_listen, F_SETFL, fcntl(sock_listen, F_GETFL, 0) | O_NONBLOCK);
+    } else {
+        sock_listen = init_reuseport_server(port_number);
+        if (affinity == AFFINITY_INCOMING && set_incoming_cpu(sock_listen, proc % cpu_count()) == -1) {
+            perror("SO_INCOMING_CPU");
+        }
+    }
+
+    if ((tids = malloc(n_threads * sizeof(pthread_t))) == NULL) {
+        clean_exit("Memory allocation failed");
+    }
+    for (i = 0; i < n_threads; i++) {
+        if ((args = malloc(sizeof(struct thread_args))) == NULL) {
+            clean_exit("Memory allocation failed");
+        }
+        args->sock = sock_listen;
+        args->thread_id = i;
+        args->cpu = affinity == AFFINITY_WORKER ? proc * n_threads + i :
+                    affinity == AFFINITY_INCOMING ? proc : -1;
+        if (pthread_create(&tids[i], NULL, event_loop, args) != 0) {
+            clean_exit("Thread creation failed");
+        }
+    }
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+}
+
+// Echo whatever is left in c->buf. Returns 1 when the session is over
+// (the echoed chunk ended with a newline), 0 to keep going, -1 on error.
+static int flush_conn(struct conn *c) {
+    while (c->off < c->len) {
+        int r = send(c->sock, c->buf + c->off, c->len - c->off, 0);
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
             }
-        } while (buf[strsize - 1] != '\n');
-        close(sock_accepted);
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        c->off += r;
+    }
+    int done = c->buf[c->len - 1] == '\n';
+    c->len = c->off = 0;
+    return done;
+}
+
+// One event-loop thread: it shares the process listener with its siblings
+// and echoes for every connection it accepted, keeping the same
+// newline-terminated session semantics as echo().
+void *event_loop(void *arg) {
+    struct thread_args *args = (struct thread_args *) arg;
+    int sock_listen = args->sock;
+    int this_thread_id = args->thread_id;
+    struct pollfd *pfd = NULL;
+    struct conn *conns = NULL;
+    int n = 0, cap = 0, i;
+
+    // Before the first allocation, so the connection table is node-local
+    if (args->cpu >= 0) {
+        pin_cpu(args->cpu);
+    }
+    free(arg);
+
+    for (;;) {
+        if (draining && n == 0) {
+            break;
+        }
+        if (n + 1 > cap) {
+            cap = cap ? cap * 2 : 64;
+            if ((pfd = realloc(pfd, (cap + 1) * sizeof(struct pollfd))) == NULL ||
+                (conns = realloc(conns, cap * sizeof(struct conn))) == NULL) {
+                clean_exit("Memory allocation failed");
+            }
+        }
+
+        // pfd[0] is the listener; pfd[i + 1] belongs to conns[i]
+        pfd[0].fd = draining ? -1 : sock_listen;
+        pfd[0].events = POLLIN;
+        for (i = 0; i < n; i++) {
+            pfd[i + 1].fd = conns[i].sock;
+            pfd[i + 1].events = conns[i].len > 0 ? POLLOUT : POLLIN;
+        }
+
+        if (poll(pfd, n + 1, DRAIN_POLL_MS) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            clean_exit("poll failed");
+        }
+
+        // Walk backwards so a closed connection can be swapped with the last one
+        for (i = n - 1; i >= 0; i--) {
+            struct conn *c = &conns[i];
+            int result = 0;
+
+            if (pfd[i + 1].revents == 0) {
+                continue;
+            }
+            if (c->len == 0) {
+                int r = recv(c->sock, c->buf, BUFSIZE, 0);
+                if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    continue;
+                }
+                if (r <= 0) {
+                    result = -1;
+                } else {
+                    c->len = r;
+                    result = flush_conn(c);
+                }
+            } else {
+                result = flush_conn(c);
+            }
+
+            if (result != 0) {
+                close(c->sock);
+                conns[i] = conns[--n];
+            }
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            int sock_accepted;
+            // Take everything that is queued; sibling threads may win some of them
+            while (n < cap && (sock_accepted = accept(sock_listen, NULL, NULL)) != -1) {
+                fcntl(sock_accepted, F_SETFL, fcntl(sock_accepted, F_GETFL, 0) | O_NONBLOCK);
+                printf("Client is accepted [pid = %d, thread_id = %d]\n", getpid(), this_thread_id);
+                conns[n].sock = sock_accepted;
+                conns[n].len = conns[n].off = 0;
+                n++;
+            }
+        }
+    }
+
+    free(pfd);
+    free(conns);
+    return NULL;
+}
+
+// Start a blocking echo worker in a free slot
+static void spawn_worker(int parallel_type, int slot) {
+    struct worker_state *w = &board[slot];
+    struct thread_args *args;
+    pid_t child;
+
+    w->retire = w->exited = 0;
+    sb_start(&scoreboard->slot[slot], 0); /* idle until the worker reports in */
+    if (parallel_type == 0) {
+        fflush(stdout); /* or the child would print the supervisor log again */
+        child = fork();
+        if (child < 0) {
+            clean_exit("Fork failed");
+        } else if (child == 0) {
+            // Child process
+            if (sock_handoff != -1) {
+                close(sock_handoff);
+            }
+            echo(sock_listen, slot);
+            exit(EXIT_SUCCESS);
+        }
+        worker_pid[slot] = child;
+    } else {
+        if ((args = malloc(sizeof(struct thread_args))) == NULL) {
+            clean_exit("Memory allocation failed");
+        }
+        args->sock = sock_listen;
+        args->thread_id = slot;
+        args->cpu = -1;
+        if (pthread_create(&worker_tid[slot], NULL, echo_thread, (void *) args) != 0) {
+            clean_exit("Thread creation failed");
+        }
+    }
+    worker_alive[slot] = 1;
+}
+
+// Interrupt a worker blocked in accept() so it sees its retire flag
+static void signal_worker(int parallel_type, int slot) {
+    if (parallel_type == 1) {
+        pthread_kill(worker_tid[slot], SIGUSR2);
+    } else {
+        kill(worker_pid[slot], SIGUSR2);
+    }
+}
+
+// Collect workers that have exited. Returns how many are still alive.
+static int reap_workers(int parallel_type, int n) {
+    int i, alive = 0;
+    pid_t pid;
+
+    if (parallel_type != 1) {
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for (i = 0; i < n; i++) {
+                if (worker_alive[i] && worker_pid[i] == pid) {
+                    worker_alive[i] = 0;
+                }
+            }
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (parallel_type == 1 && worker_alive[i] && board[i].exited) {
+            pthread_join(worker_tid[i], NULL);
+            worker_alive[i] = 0;
+        }
+        alive += worker_alive[i];
+    }
+    return alive;
+}
+
+// Connections that finished the handshake but are not accepted yet.
+// Only Linux reports it (in tcpi_unacked for a listening socket); elsewhere
+// the supervisor goes by the busy ratio alone.
+static int accept_queue_len(int sock) {
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        return info.tcpi_unacked;
+    }
+#else
+    (void)sock;
+#endif
+    return 0;
+}
+
+// Keep between min_workers and max_workers blocking workers on the shared
+// listener. The pool grows while connections wait in the accept queue or
+// every worker is in a session, and once demand has stayed at least two
+// workers below the pool size for cooldown seconds, the longest idle worker
+// is retired after its current session. Every decision is logged.
+void supervise(int parallel_type, int min_workers, int max_workers, int cooldown) {
+    struct pollfd pfd;
+    int i, n, alive, active, busy, queued, idle, before;
+    time_t now, calm_since = time(NULL);
+
+    for (i = 0; i < min_workers; i++) {
+        spawn_worker(parallel_type, i);
+    }
+    printf("[supervisor] %d workers (min %d, max %d, backlog %d, cooldown %ds)\n",
+           min_workers, min_workers, max_workers, backlog, cooldown);
+
+    for (;;) {
+        // The upgrade socket doubles as the sampling timer (-1 is ignored by poll)
+        pfd.fd = sock_handoff;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, SUPERVISE_MS) > 0) {
+            hand_off();
+            drain_workers(parallel_type, max_workers);
+            exit(EXIT_SUCCESS);
+        }
+
+        alive = reap_workers(parallel_type, max_workers);
+        active = busy = 0;
+        for (i = 0; i < max_workers; i++) {
+            if (!worker_alive[i]) {
+                continue;
+            }
+            if (board[i].retire) {
+                signal_worker(parallel_type, i); /* it may have missed the first one */
+            } else {
+                active++;
+                busy += scoreboard->slot[i].state == SB_BUSY;
+            }
+        }
+        queued = accept_queue_len(sock_listen);
+        now = time(NULL);
+
+        if (active < min_workers || (active < max_workers && (queued > 0 || busy == active))) {
+            // One worker per waiting connection, or one more when all are busy
+            n = active < min_workers ? min_workers - active : (queued > 0 ? queued : 1);
+            if (n > max_workers - active) {
+                n = max_workers - active;
+            }
+            before = active;
+            for (i = 0; i < max_workers && n > 0 && alive < max_workers; i++) {
+                if (!worker_alive[i]) {
+                    spawn_worker(parallel_type, i);
+                    printf("[supervisor] spawn worker %d (%s, busy %d/%d, queued %d) -> %d workers\n",
+                           i, before < min_workers ? "below minimum" : queued > 0 ? "queued" : "all busy",
+                           busy, before, queued, active + 1);
+                    active++;
+                    alive++;
+                    n--;
+                }
+            }
+            calm_since = now;
+            continue;
+        }
+
+        if (busy + queued >= active - 1) {
+            calm_since = now;
+        } else if (active > min_workers && now - calm_since >= cooldown) {
+            idle = -1;
+            for (i = 0; i < max_workers; i++) {
+                if (worker_alive[i] && !board[i].retire && scoreboard->slot[i].state != SB_BUSY &&
+                    (idle == -1 || scoreboard->slot[i].since < scoreboard->slot[idle].since)) {
+                    idle = i;
+                }
+            }
+            if (idle != -1) {
+                board[idle].retire = 1;
+                signal_worker(parallel_type, idle);
+                printf("[supervisor] retire worker %d (idle %lds, busy %d/%d, queued %d) -> %d workers\n",
+                       idle, (long)((sb_now() - scoreboard->slot[idle].since) / 1000), busy, active, queued, active - 1);
+            }
+        }
+    }
+}
+
+// Ask every worker to finish its session and exit. A worker that was between
+// its retire check and accept() misses the signal, so keep re-sending it.
+void drain_workers(int parallel_type, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        board[i].retire = 1;
+    }
+    while (reap_workers(parallel_type, n) > 0) {
+        for (i = 0; i < n; i++) {
+            if (worker_alive[i]) {
+                signal_worker(parallel_type, i);
+            }
+        }
+        usleep(100000);
     }
 }
 
+void drain_handler(int sig) {
+    (void)sig;
+    draining = 1;
+}
+
 void print_usage(char *program_name) {
-    fprintf(stderr, "\nUsage: %s <port_number> <parallel_type> <connection_limit>\n\n"
+    fprintf(stderr, "\nUsage: %s [-U upgrade_path] [-t threads] [-b backlog] [-M max_workers] [-i cooldown] [-s]\n"
+                "       [-a worker|incoming] [-S scoreboard] <port_number> <parallel_type> <connection_limit>\n\n"
                 "Options:\n"
+                "  -t threads          Event-loop threads per process for parallel_type 2 (default 4).\n"
+                "  -b backlog          Listen backlog (default 5).\n"
+                "  -M max_workers      Let parallel_type 0/1 grow up to max_workers workers while\n"
+                "                      connections queue up (default: connection_limit, a fixed pool).\n"
+                "  -i cooldown         Seconds of low load before idle workers are retired (default 10).\n"
+                "  -s                  parallel_type 0/1: echo with splice() through a pipe instead\n"
+                "                      of copying through a 50-byte buffer.\n"
+                "  -a worker           Pin worker n (thread n of process p in type 2) to a CPU.\n"
+                "  -a incoming         Follow SO_INCOMING_CPU: types 0/1 move a worker to the CPU\n"
+                "                      that received its connection; in type 2 process p owns CPU p.\n"
+                "  -S scoreboard       File backing the worker scoreboard (parallel_type 0/1),\n"
+                "                      so ./sbview can watch it live.\n"
+                "  -U upgrade_path     Unix socket path for hot upgrades. A new binary started\n"
+                "                      with the same path takes over the listening socket.\n"
                 "  <port_number>       Specifies the port number the server will listen on.\n"
                 "                      This should be a value between 1024 and 65535.\n"
                 "  <parallel_type>     Indicates the type of parallel processing to use:\n"
                 "                      0 - Process-based parallelism (using fork)\n"
                 "                      1 - Thread-based parallelism (using pthreads)\n"
-                "  <connection_limit>  The maximum number of concurrent connections\n"
-                "                      that the server will handle at one time.\n\n"
+                "  <connection_limit>  The number of workers started up front, which is also\n"
+                "                      the minimum the pool shrinks back to.\n"
+                "                      For parallel_type 2, the number of processes.\n\n"
                 "Example:\n"
                 "  %s 8080 1 5     # Starts the server on port 8080 with thread-based parallelism\n"
                 "                       # and suggested to test between 5~10 concurrent connections.\n\n",
@@ -9,16 +9,37 @@
     サーバーコマンド:
     ./task4 -S -p 12345 -c 3
 
+    -c のクライアント数を超えると表を倍々に広げて受け付ける。-m で上限を指定できる
+    (上限 10000 人):
+    ./task4 -S -p 12345 -c 100 -m 10000
+
+    流量制限 (クライアントごとに1秒あたり5メッセージ、バースト10):
+    ./task4 -S -p 12345 -c 3 -r 5 -b 10
+    kill -USR1 <pid> でクライアントごとの通過数・破棄数を表示する
+
+    無停止入れ替え (新しいバイナリを同じ -U で起動すると、リスニングソケットと
+    接続中のクライアントを古いプロセスから引き継ぎ、古いプロセスは終了する):
+    ./task4 -S -p 12345 -c 3 -U /tmp/task4.sock
+    ./task4 -S -p 12345 -c 3 -U /tmp/task4.sock   (新しいバイナリで)
+
+    ログイン性能の測定 (500接続を一斉に開き、全員の入室までの時間を表示する):
+    ./task4 -S -p 12345 -c 501
+    ./task4 -B -s localhost -p 12345 -n 500
+
     クライアントコマンド:
     ./task4 -C -s localhost -p 12345
 
+    クライアントが ROSTER と送ると "ROSTER <人数>" に続けて参加者の名前を1行ずつ返す。
+    以降そのクライアントには入退室の文章の代わりに "+名前" / "-名前" の差分が届く。
+
     --------------------------------------------------
 
-    この課題４はスレッドを使用してN人でのチャットを実現する。
+    この課題４はpollによるイベント駆動でN人でのチャットを実現する。
     オプション指定に関してははquizのサンプルプログラムから流用している。
 
     工夫した点:
-    - スレッドを使用して、複数のクライアントが同時に接続できるようにした。
+    - 接続ごとにスレッドを作らず、名前の受信待ち (AWAIT_NAME) からログイン済み (LOGGED_IN) への
+      状態遷移をメインループで処理するようにした。名前を LOGIN_TIMEOUT 秒以内に送らない接続は閉じる。
     - サーバーが起動中で、チャットルームが満員でない場合は自由に出入りできるようにした。
     - クライアントの入退室を他のクライアントに通知するようにした。
 
@@ -29,8 +50,13 @@
  */
 
 #include <mynet.h>
-#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/select.h>
+#include <sys/resource.h>
 
 #define SERVER_LEN 256 /* サーバ名格納用バッファサイズ */
 #define DEFAULT_PORT 12345 /* ポート番号既定値 */
@@ -39,10 +65,20 @@
 
 #define NAMELENGTH 20 /* 名前の最大長 */
 #define BUFLEN 1000 /* 通信バッファサイズ */
+#define DRR_QUANTUM 500 /* 1巡で1クライアントに処理させる行のバイト数 (受信バッファより小さくする) */
+#define DEFAULT_BURST 10 /* 流量制限のバースト既定値 */
 
 #define INVALID -1
 #define LOGGED_OUT 0
 #define LOGGED_IN 1
+#define AWAIT_NAME 2 /* 接続済みで名前の受信待ち */
+
+#define LOGIN_TIMEOUT 10 /* 名前を送るまでの制限時間(秒) */
+
+/* 無停止入れ替えで送るレコードの種類 */
+#define HANDOFF_LISTEN 0 /* リスニングソケット */
+#define HANDOFF_CLIENT 1 /* 接続中のクライアント */
+#define HANDOFF_END 2 /* 引き継ぎの終わり (新しいプロセスは長さ0のレコードで応える) */
 
 extern char *optarg;
 extern int optind, opterr, optopt;
@@ -52,19 +88,64 @@ typedef struct {
     int sock;
     char name[NAMELENGTH];
     int state;
-    pthread_t thread;
+    time_t deadline; /* AWAIT_NAMEのときのログイン期限 */
+    int deficit; /* DRRで処理できる残りバイト数 (行の単位で使う) */
+    char in[BUFLEN]; /* 受信して、まだ処理していないデータ */
+    int in_len;
+    token_bucket bucket; /* メッセージの流量制限 */
+    int pos; /* Active内の位置 */
+    int roster; /* 名簿の差分を受け取る */
+    outq out; /* 送り切れなかったメッセージ */
+    int closing; /* 送信に失敗したか読まずにキューがあふれた。ループの最後でログアウトさせる */
 } client_info;
 
+/* 無停止入れ替えで新しいプロセスに渡すクライアントの状態 */
+typedef struct {
+    int kind;
+    int state;
+    int roster;
+    time_t deadline;
+    char name[NAMELENGTH];
+    int in_len;
+    char in[BUFLEN]; /* 受信済みで未処理のデータもそのまま渡す */
+    size_t out_len; /* 続けて送る送信キューの未送信バイト数 */
+} handoff_record;
+
 /* プライベート変数 */
-static int N_client; /* クライアントの数 */
+static int N_client; /* クライアント数のソフトリミット (表の初期サイズ) */
+static int Max_client = 0; /* クライアント数のハードリミット (0なら無制限) */
+static int Capacity; /* 確保済みのスロット数 */
 static client_info *Client; /* クライアントの情報 */
+static int *Free_slot; /* 空きスロットのスタック */
+static int N_free; /* 空きスロットの数 */
+static int *Active; /* 使用中のスロットの一覧 */
+static int N_active; /* 使用中のスロットの数 */
+static int *Slot_of_fd; /* ファイルディスクリプタからスロットへの対応 */
+static int N_fd; /* Slot_of_fdの大きさ */
+static int N_awaiting; /* 名前の受信待ちの接続数 */
+static struct pollfd *Pfd; /* pollに渡す配列 */
+static int N_logged_in; /* ログイン済みのクライアント数 */
+static int N_subscriber; /* 名簿の差分を受け取るクライアント数 */
+static char *Roster; /* 名簿を組み立てるバッファ */
+static size_t Roster_size; /* Rosterの確保済みサイズ */
+static outmsg *Roster_msg; /* 送信する形に整えた名簿 (要求したクライアントのキューで共有する) */
+static int Roster_dirty = 1; /* 入退室があり名簿を作り直す必要がある */
 static int sock_listen; /* リスニングソケット */
-static fd_set master_fds; /* マスターファイルディスクリプタセット */
-static int max_sd; /* 最大ファイルディスクリプタ値 */
+static char *Upgrade_path = NULL; /* 無停止入れ替えに使うUnixソケットのパス */
+static int sock_handoff = INVALID; /* 新しいプロセスからの引き継ぎ要求を待つソケット */
+static int Spare_fd = INVALID; /* ディスクリプタが尽きたときに手放して接続を断るための予備 */
+static double Rate_limit = 0; /* クライアントごとの1秒あたりのメッセージ数 (0なら無制限) */
+static double Rate_burst = DEFAULT_BURST; /* 流量制限のバースト */
+static volatile sig_atomic_t Dump_stats = 0; /* SIGUSR1で統計を表示する */
 
 /* プライベート関数 */
 static void broadcast(int sender_sock, const char *message);
+static void flush_clients();
+static void announce(int client_index, int joined);
 static void handle_logout(int client_index);
+static void drop_login(int i);
+static int alloc_slot(int sock);
+static void hand_off();
 
 /**
  * ソケット操作のラッパー関数である。処理に失敗した場合、exit()を呼び出してプログラム全体を終了させる。
@@ -94,72 +175,343 @@ int Recv(int s, void *buf, size_t len, int flags) {
 }
 
 /**
- * 新しいクライアントのログインを処理する関数である。
- * 新しいクライアントが接続すると、その名前を受信し、クライアントリストに追加する。
+ * ディスクリプタが尽きて受け付けられない接続を断る関数である。
+ * 待ち行列に接続が残るとリスニングソケットは読み込み可能のままで、pollが空回りする。
+ * 予備のディスクリプタを手放して受け付け、満員を伝えてすぐに閉じる。
  */
-static void *client_login(void *arg) 
+static void shed_clients()
 {
-    int client_sock = *(int *)arg;
-    free(arg);
+    char *message = "Sorry. The Server is currently full at the moment.\n";
+    int client_sock, shed = 0;
+
+    if (Spare_fd == INVALID) {
+        /* 手放す予備がなければ次のために確保し、空回りしないよう少し待つ */
+        Spare_fd = open("/dev/null", O_RDONLY);
+        poll(NULL, 0, 100);
+        return;
+    }
+    close(Spare_fd);
+    while ((client_sock = accept(sock_listen, NULL, NULL)) != -1) {
+        send(client_sock, message, strlen(message), MSG_DONTWAIT);
+        close(client_sock);
+        shed++;
+    }
+    Spare_fd = open("/dev/null", O_RDONLY);
+    fprintf(stderr, "Out of file descriptors: turned away %d clients\n", shed);
+}
+
+/**
+ * 新しい接続を受け付ける関数である。
+ * 受け付けた接続は名前を待つ状態 (AWAIT_NAME) として登録し、名前の受信はメインループで行う。
+ * 接続が集中しても、待ち行列にある接続を1回の呼び出しですべて受け付ける。
+ */
+static void accept_clients()
+{
+    int client_sock;
+
+    while ((client_sock = accept(sock_listen, NULL, NULL)) != -1) {
+        int i;
+
+        /* 1人のクライアントでサーバ全体が止まらないよう、送受信はノンブロッキングで行う */
+        fcntl(client_sock, F_SETFL, fcntl(client_sock, F_GETFL, 0) | O_NONBLOCK);
+
+        if ((i = alloc_slot(client_sock)) == INVALID) {
+            // ハードリミットに達している場合
+            char *message = "Sorry. The Server is currently full at the moment.\n";
+            send(client_sock, message, strlen(message), 0);
+            close(client_sock);
+            continue;
+        }
+
+        Client[i].state = AWAIT_NAME;
+        Client[i].deadline = time(NULL) + LOGIN_TIMEOUT;
+        N_awaiting++;
+    }
+
+    if (errno == EMFILE || errno == ENFILE) {
+        shed_clients();
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("accept()");
+    }
+}
+
+/**
+ * 名前を待っているクライアントのログインを処理する関数である。
+ * 名前を受信したらログイン状態にして、他のクライアントに入室を通知する。
+ */
+static void client_login(int i)
+{
+    int client_sock = Client[i].sock;
     char name[NAMELENGTH];
 
     // クライアントの名前を受信する
     int len = recv(client_sock, name, NAMELENGTH - 1, 0);
-    if (len > 0) {
-        name[len] = '\0';
-    } else {
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (len <= 0) {
         printf("Failed to receive client name, closing socket %d\n", client_sock);
-        close(client_sock);
-        return NULL;
+        drop_login(i);
+        return;
     }
+    name[len] = '\0';
 
-    for (int i = 0; i < N_client; i++) {
-        if (Client[i].state == LOGGED_OUT) {
-            Client[i].sock = client_sock;
-            snprintf(Client[i].name, NAMELENGTH, "%s", name);
-            Client[i].state = LOGGED_IN;
-            FD_SET(client_sock, &master_fds);
-            if (client_sock > max_sd) {
-                max_sd = client_sock;
-            }
-            printf("Client %s connected on socket %d\n", name, client_sock);
-            char enter_msg[BUFLEN];
-            snprintf(enter_msg, BUFLEN, "Client %s has entered the chat.\n", name);
-            broadcast(client_sock, enter_msg);
-            return NULL;
+    snprintf(Client[i].name, NAMELENGTH, "%s", name);
+    Client[i].deficit = 0;
+    Client[i].in_len = 0;
+    Client[i].roster = 0;
+    tb_init(&Client[i].bucket, Rate_limit, Rate_burst);
+    Client[i].state = LOGGED_IN;
+    N_awaiting--;
+    N_logged_in++;
+    printf("Client %s connected on socket %d\n", name, client_sock);
+    announce(i, 1);
+}
+
+/**
+ * クライアント表を広げる関数である。ハードリミットに達していれば0を返す。
+ * 最初はソフトリミットの大きさで確保し、以降は倍々に広げる。
+ * 広げた分のスロットは空きスロットのスタックに積む。
+ */
+static int grow_table()
+{
+    int cap = Capacity > 0 ? Capacity * 2 : N_client;
+
+    if (Max_client > 0 && cap > Max_client) {
+        cap = Max_client;
+    }
+    if (cap <= Capacity) {
+        return 0;
+    }
+    if ((Client = (client_info *)realloc(Client, cap * sizeof(client_info))) == NULL ||
+        (Free_slot = (int *)realloc(Free_slot, cap * sizeof(int))) == NULL ||
+        (Active = (int *)realloc(Active, cap * sizeof(int))) == NULL ||
+        (Pfd = (struct pollfd *)realloc(Pfd, (cap + 2) * sizeof(struct pollfd))) == NULL) {
+        exit_errmesg("realloc()");
+    }
+    /* 番号の小さいスロットから使われるように逆順に積む */
+    for (int i = cap - 1; i >= Capacity; i--) {
+        Client[i].state = LOGGED_OUT;
+        Client[i].sock = INVALID;
+        Client[i].closing = 0;
+        memset(&Client[i].out, 0, sizeof(outq));
+        Free_slot[N_free++] = i;
+    }
+    if (Capacity > 0) {
+        printf("Client table grown to %d slots (soft limit %d)\n", cap, N_client);
+    }
+    Capacity = cap;
+    return 1;
+}
+
+/**
+ * 空きスロットを1つ取り出して使用中にする関数である。
+ * 空きがなければ表を広げ、ハードリミットに達していればINVALIDを返す。
+ */
+static int alloc_slot(int sock)
+{
+    if (N_free == 0 && !grow_table()) {
+        return INVALID;
+    }
+    int i = Free_slot[--N_free];
+
+    if (sock >= N_fd) {
+        int n = N_fd;
+        N_fd = sock * 2;
+        if ((Slot_of_fd = (int *)realloc(Slot_of_fd, N_fd * sizeof(int))) == NULL) {
+            exit_errmesg("realloc()");
+        }
+        while (n < N_fd) {
+            Slot_of_fd[n++] = INVALID;
         }
     }
+    Slot_of_fd[sock] = i;
+    Client[i].sock = sock;
+    Client[i].pos = N_active;
+    Active[N_active++] = i;
+    return i;
+}
 
-    // 空きスロットがない場合
-    char *message = "Sorry. The Server is currently full at the moment.\n";
-    send(client_sock, message, strlen(message), 0);
-    close(client_sock);
-    return NULL;
+/**
+ * ソケットを閉じてスロットを空きスロットのスタックに戻す関数である。
+ * Activeからは最後の要素と入れ替えて取り除く。
+ */
+static void free_slot(int i)
+{
+    int last = Active[--N_active];
+
+    Active[Client[i].pos] = last;
+    Client[last].pos = Client[i].pos;
+    Slot_of_fd[Client[i].sock] = INVALID;
+    close(Client[i].sock);
+    outq_clear(&Client[i].out);
+    Client[i].sock = INVALID;
+    Client[i].state = LOGGED_OUT;
+    Client[i].closing = 0;
+    Free_slot[N_free++] = i;
+}
+
+/**
+ * ログインを完了しなかった接続を閉じてスロットを空ける関数である。
+ */
+static void drop_login(int i)
+{
+    N_awaiting--;
+    free_slot(i);
+}
+
+/**
+ * 期限までに名前を送ってこなかった接続を閉じる関数である。
+ * 次の期限までの秒数を返す (名前を待っている接続がなければ-1)。
+ */
+static int expire_logins()
+{
+    time_t now = time(NULL);
+    int next = -1;
+
+    if (N_awaiting == 0) {
+        return -1;
+    }
+    for (int k = 0; k < N_active; k++) {
+        int i = Active[k];
+        if (Client[i].state != AWAIT_NAME) continue;
+        if (Client[i].deadline <= now) {
+            printf("Login timed out, closing socket %d\n", Client[i].sock);
+            drop_login(i);
+            k--; /* 最後の要素がこの位置に移ってくる */
+        } else if (next == -1 || Client[i].deadline - now < next) {
+            next = Client[i].deadline - now;
+        }
+    }
+    return next;
 }
 
 /**
  * クライアント情報を初期化する関数である。
- * 指定されたクライアント数分のメモリを確保し、初期状態に設定する。
+ * 指定されたクライアント数分の表を確保し、足りなくなったら倍々に広げる。
  */
 static void init_client(int n_client) {
-    N_client = n_client;
-    if ((Client = (client_info *)malloc(N_client * sizeof(client_info))) == NULL) {
-        exit_errmesg("malloc()");
-    }
-    for (int i = 0; i < N_client; i++) {
-        Client[i].state = LOGGED_OUT;
-        Client[i].sock = INVALID;
+    N_client = n_client > 0 ? n_client : 1;
+    grow_table();
+}
+
+/**
+ * クライアントの送信キューにメッセージを入れる関数である。実際の送信はflush_clients()で行う。
+ * メッセージの一部だけを捨てることはせず、読まないままキューが上限を超えたクライアントは切断する。
+ */
+static void enqueue(int i, outmsg *m) {
+    if (Client[i].closing) return;
+    if (outq_push(&Client[i].out, m, 0) == -1) {
+        printf("Client %s is not reading its messages, disconnecting.\n", Client[i].name);
+        Client[i].closing = 1;
     }
 }
 
 /**
  * すべてのクライアントにメッセージを送信する関数である。
+ * メッセージは1つのバッファを全員のキューで共有する。
  */
 static void broadcast(int sender_sock, const char *message) {
-    for (int i = 0; i < N_client; i++) {
+    outmsg *m = outmsg_bytes(message, strlen(message));
+
+    for (int k = 0; k < N_active; k++) {
+        int i = Active[k];
         if (Client[i].state == LOGGED_IN && Client[i].sock != sender_sock) {
-            Send(Client[i].sock, (void *)message, strlen(message), 0);
+            enqueue(i, m);
+        }
+    }
+    outmsg_release(m);
+}
+
+/**
+ * 送信キューにたまったメッセージを送る関数である。ソケットが一杯で残った分はPOLLOUTを待って送る。
+ * 送信に失敗したクライアントと、キューがあふれたクライアントはここでログアウトさせる。
+ * ログアウトの通知でさらに別のクライアントがあふれることもあるので、なくなるまで繰り返す。
+ */
+static void flush_clients() {
+    int dropped;
+
+    do {
+        for (int k = 0; k < N_active; k++) {
+            int i = Active[k];
+            if (!Client[i].closing && Client[i].out.count > 0 && !Client[i].out.blocked &&
+                outq_flush(Client[i].sock, &Client[i].out) == -1) {
+                Client[i].closing = 1;
+            }
         }
+        dropped = 0;
+        for (int k = 0; k < N_active; k++) {
+            int i = Active[k];
+            if (Client[i].closing) {
+                handle_logout(i);
+                dropped = 1;
+                k--; /* 最後の要素がこの位置に移ってくる */
+            }
+        }
+    } while (dropped);
+}
+
+/**
+ * 入退室を他のクライアントに通知する関数である。
+ * 名簿を購読しているクライアントには "+名前" / "-名前" の1行だけを送り、
+ * それ以外のクライアントには従来どおりの文章で知らせる。
+ */
+static void announce(int client_index, int joined) {
+    char message[BUFLEN], delta[NAMELENGTH + 2];
+    const char *name = Client[client_index].name;
+
+    if (joined) {
+        snprintf(message, BUFLEN, "Client %s has entered the chat.\n", name);
+    } else {
+        snprintf(message, BUFLEN, "\nClient %s has logged out.\n", name);
+    }
+    snprintf(delta, sizeof(delta), "%c%s\n", joined ? '+' : '-', name);
+    outmsg *m_message = outmsg_bytes(message, strlen(message));
+    outmsg *m_delta = outmsg_bytes(delta, strlen(delta));
+    Roster_dirty = 1;
+
+    /* 差分を1つでも落とすと購読者の名簿が食い違ったままになるので、必ずキューに入れる */
+    for (int k = 0; k < N_active; k++) {
+        int i = Active[k];
+        if (Client[i].state != LOGGED_IN || i == client_index) continue;
+        enqueue(i, Client[i].roster ? m_delta : m_message);
+    }
+    outmsg_release(m_message);
+    outmsg_release(m_delta);
+}
+
+/**
+ * ROSTERコマンドに名簿を返し、以降の入退室を差分で送るようにする関数である。
+ * 名簿は "ROSTER <人数>" の行に続けて1行に1人ずつ名前を並べたもので、
+ * 入退室があったときだけ作り直すので、それ以外の要求ではそのまま送るだけで済む。
+ */
+static void send_roster(int client_index) {
+    if (Roster_dirty) {
+        size_t need = 32 + (size_t)N_logged_in * NAMELENGTH;
+        if (need > Roster_size) {
+            Roster_size = need * 2;
+            if ((Roster = (char *)realloc(Roster, Roster_size)) == NULL) {
+                exit_errmesg("realloc()");
+            }
+        }
+        size_t len = snprintf(Roster, Roster_size, "ROSTER %d\n", N_logged_in);
+        for (int k = 0; k < N_active; k++) {
+            int i = Active[k];
+            if (Client[i].state != LOGGED_IN) continue;
+            len += snprintf(Roster + len, Roster_size - len, "%s\n", Client[i].name);
+        }
+        if (Roster_msg != NULL) {
+            outmsg_release(Roster_msg);
+        }
+        Roster_msg = outmsg_bytes(Roster, len);
+        Roster_dirty = 0;
+    }
+
+    /* 名簿は大きくなりうるので、他の送信と同じくキューに入れてノンブロッキングで送る */
+    enqueue(client_index, Roster_msg);
+    if (!Client[client_index].roster) {
+        Client[client_index].roster = 1;
+        N_subscriber++;
     }
 }
 
@@ -167,56 +519,294 @@ static void broadcast(int sender_sock, const char *message) {
  * クライアントのログアウトを処理し、他のクライアントに通知する関数である。
  */
 static void handle_logout(int client_index) {
-    char message[BUFLEN];
-    snprintf(message, BUFLEN, "\nClient %s has logged out.\n", Client[client_index].name);
-    broadcast(Client[client_index].sock, message);
-    close(Client[client_index].sock);
-    FD_CLR(Client[client_index].sock, &master_fds);
-    Client[client_index].sock = INVALID;
-    Client[client_index].state = LOGGED_OUT;
+    announce(client_index, 0);
+    N_logged_in--;
+    if (Client[client_index].roster) {
+        N_subscriber--;
+    }
+    free_slot(client_index);
     printf("Client %s disconnected.\n", Client[client_index].name);
 }
 
+static void stats_handler(int sig) {
+    (void)sig;
+    Dump_stats = 1;
+}
+
+/**
+ * クライアントごとの流量制限の統計を表示する関数である。
+ */
+static void print_stats() {
+    printf("--- %d clients, %d roster subscribers ---\n", N_logged_in, N_subscriber);
+    printf("--- rate limit: %.1f msg/s, burst %.0f ---\n", Rate_limit, Rate_burst);
+    for (int k = 0; k < N_active; k++) {
+        int i = Active[k];
+        if (Client[i].state == LOGGED_IN) {
+            printf("%-20s passed %lu, dropped %lu\n", Client[i].name,
+                   Client[i].bucket.passed, Client[i].bucket.dropped);
+        }
+    }
+    fflush(stdout);
+}
+
+/**
+ * クライアントから受け取った1行 (メッセージ1つ) を処理する関数である。
+ * 流量制限はメッセージ単位で数え、制限を超えたメッセージは表示も配信もしない。
+ */
+static void handle_line(int i, char *line) {
+    char message[BUFLEN + NAMELENGTH + 4];
+
+    /* telnetの "ROSTER\r\n" も受け付けるよう、行末を除いて比べる */
+    line[strcspn(line, "\r")] = '\0';
+    if (strcmp(line, "ROSTER") == 0) {
+        send_roster(i);
+        return;
+    }
+    if (!tb_take(&Client[i].bucket)) {
+        return; /* 流量制限を超えたメッセージは配らずに捨てる */
+    }
+    printf("Received from %s: %s\n", Client[i].name, line);
+    snprintf(message, sizeof(message), "%s: %s\n", Client[i].name, line);
+    broadcast(Client[i].sock, message);
+}
+
+/**
+ * 受信バッファにたまった行を、DRRの持ち分 (deficit) の範囲で1行ずつ処理する関数である。
+ * 持ち分に収まらない行は次の巡回まで残すので、長いメッセージが途中で区切られることはない。
+ * 処理を待つ行が残っていれば1を返す。
+ */
+static int serve_lines(int i) {
+    char *line = Client[i].in, *end = Client[i].in + Client[i].in_len, *nl;
+
+    Client[i].deficit += DRR_QUANTUM;
+    while ((nl = memchr(line, '\n', end - line)) != NULL && nl - line + 1 <= Client[i].deficit) {
+        Client[i].deficit -= nl - line + 1;
+        *nl = '\0';
+        handle_line(i, line);
+        line = nl + 1;
+    }
+    Client[i].in_len = end - line;
+    memmove(Client[i].in, line, Client[i].in_len);
+    if (memchr(Client[i].in, '\n', Client[i].in_len) != NULL) {
+        return 1;
+    }
+    /* 処理を待つ行がなければ持ち分は持ち越さない */
+    Client[i].deficit = 0;
+    if (Client[i].in_len >= BUFLEN - 2) {
+        Client[i].in_len = 0; /* 長すぎる行は捨てる */
+    }
+    return 0;
+}
+
 /**
  * サーバのメインループを実行する関数である。
  * 新しいクライアントの接続を受け入れ、既存のクライアントからのメッセージを処理する。
+ * 受信は開始位置を1つずつずらしながら、1巡ごとにDRR_QUANTUMバイト分ずつ行を処理する (Deficit Round Robin)。
  */
 static void server_loop() {
-    fd_set read_fds;
     int activity;
+    int rr_start = 0;
+    int backlog = 0; /* 持ち分を使い切って処理を待っている行がある */
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stats_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+    Spare_fd = open("/dev/null", O_RDONLY);
 
     while (1) {
-        read_fds = master_fds;
+        if (Dump_stats) {
+            Dump_stats = 0;
+            print_stats();
+        }
 
-        activity = select(max_sd + 1, &read_fds, NULL, NULL, NULL);
+        /* 名前を待っている接続があれば、最も近い期限で起きる */
+        int wait_sec = expire_logins();
+        int timeout = wait_sec >= 0 ? wait_sec * 1000 : -1;
+        if (backlog) {
+            timeout = 0; /* 処理を待つ行があれば、次の巡回をすぐに始める */
+        }
+
+        /* 使用中のスロットだけをpollに渡す (先頭はリスニングソケットと引き継ぎ用のソケット) */
+        int n_pfd = 0;
+        Pfd[n_pfd].fd = sock_listen;
+        Pfd[n_pfd++].events = POLLIN;
+        Pfd[n_pfd].fd = sock_handoff; /* 負ならpollは無視する */
+        Pfd[n_pfd++].events = POLLIN;
+        for (int k = 0; k < N_active; k++) {
+            Pfd[n_pfd].fd = Client[Active[k]].sock;
+            Pfd[n_pfd++].events = Client[Active[k]].out.count > 0 ? POLLIN | POLLOUT : POLLIN;
+        }
+
+        activity = poll(Pfd, n_pfd, timeout);
         if (activity < 0) {
-            exit_errmesg("select()");
+            if (errno == EINTR) continue;
+            exit_errmesg("poll()");
         }
 
-        if (FD_ISSET(sock_listen, &read_fds)) {
-            int *new_sock = malloc(sizeof(int));
-            *new_sock = Accept(sock_listen, NULL, NULL);
-            pthread_t tid;
-            pthread_create(&tid, NULL, client_login, (void *)new_sock);
+        /* 未読のデータはソケットに残したまま新しいプロセスへ渡す */
+        if (Pfd[1].revents & POLLIN) {
+            hand_off();
         }
 
-        for (int i = 0; i < N_client; i++) {
-            int sd = Client[i].sock;
-            if (sd != INVALID && FD_ISSET(sd, &read_fds)) {
-                char buf[BUFLEN];
-                int len = recv(sd, buf, BUFLEN - 1, 0);
-                if (len <= 0) {
+        /* 受付で表が広がるとPfdが移動するので、先にクライアントの結果を処理する */
+        int n_ready = n_pfd - 2;
+        int listen_ready = Pfd[0].revents & POLLIN;
+
+        backlog = 0;
+        for (int k = 0; k < n_ready; k++) {
+            struct pollfd *p = &Pfd[2 + (rr_start + k) % n_ready];
+            int i = Slot_of_fd[p->fd];
+            if (i == INVALID) continue; /* この巡回の中で切断済み */
+            if (p->revents & POLLOUT) {
+                Client[i].out.blocked = 0; /* flush_clients()で続きを送る */
+            }
+            int readable = p->revents & (POLLIN | POLLHUP | POLLERR);
+            if (Client[i].state == AWAIT_NAME) {
+                if (readable) client_login(i);
+                continue;
+            }
+            /* 改行を付ける余地を残して読む */
+            int want = BUFLEN - 2 - Client[i].in_len;
+            if (readable && want > 0) {
+                int fresh = Client[i].in_len == 0;
+                int len = recv(p->fd, Client[i].in + Client[i].in_len, want, 0);
+                if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
                     handle_logout(i);
-                } else {
-                    buf[len] = '\0';
-                    printf("Received from %s: %s\n", Client[i].name, buf);
-                    char message[BUFLEN];
-                    snprintf(message, BUFLEN, "%s: %s", Client[i].name, buf);
-                    broadcast(sd, message);
+                    continue;
+                }
+                if (len > 0) {
+                    Client[i].in_len += len;
+                    /* 改行を送らないクライアントは、1回のrecvを1つのメッセージとして扱う */
+                    if (fresh && memchr(Client[i].in, '\n', Client[i].in_len) == NULL) {
+                        Client[i].in[Client[i].in_len++] = '\n';
+                    }
                 }
             }
+            if (Client[i].in_len > 0) {
+                backlog |= serve_lines(i);
+            }
+        }
+        rr_start = n_ready > 0 ? (rr_start + 1) % n_ready : 0;
+        flush_clients();
+
+        if (listen_ready) {
+            accept_clients();
+        }
+    }
+}
+
+/**
+ * 新しいプロセスにリスニングソケットと接続中のクライアントを渡して終了する関数である。
+ * クライアントの接続は切れないので、入れ替えで再接続が殺到することはない。
+ * リスニングソケットは共有されるので、待ち行列にある接続も失われない。
+ * 送信キューの未送信分もソケットに続けて渡す。新しいプロセスが受け取り終えたと応えるまでは終了せず、
+ * 途中で失敗したときはそのままクライアントを受け持ち続ける。
+ */
+static void hand_off() {
+    handoff_record rec;
+    int conn, fd;
+
+    if ((conn = handoff_accept(sock_handoff)) == -1) {
+        return;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = HANDOFF_LISTEN;
+    if (handoff_send(conn, sock_listen, &rec, sizeof(rec)) == -1) {
+        goto failed;
+    }
+    for (int k = 0; k < N_active; k++) {
+        int i = Active[k];
+        rec.kind = HANDOFF_CLIENT;
+        rec.state = Client[i].state;
+        rec.roster = Client[i].roster;
+        rec.deadline = Client[i].deadline;
+        memcpy(rec.name, Client[i].name, NAMELENGTH);
+        rec.in_len = Client[i].in_len;
+        memcpy(rec.in, Client[i].in, Client[i].in_len);
+        rec.out_len = Client[i].out.bytes;
+        if (handoff_send(conn, Client[i].sock, &rec, sizeof(rec)) == -1 ||
+            handoff_send_outq(conn, &Client[i].out) == -1) {
+            goto failed;
         }
     }
+    rec.kind = HANDOFF_END;
+    if (handoff_send(conn, INVALID, &rec, sizeof(rec)) == -1 || handoff_recv(conn, &fd, NULL, 0) != 0) {
+        goto failed;
+    }
+    close(conn);
+
+    printf("Handed off %d clients to the new process.\n", N_active);
+    exit(EXIT_SUCCESS);
+
+failed:
+    /* 新しいプロセスはENDを受け取れなければ終了し、渡したソケットはこちらに残っている */
+    fprintf(stderr, "Hot upgrade aborted, still serving.\n");
+    close(conn);
+}
+
+/**
+ * 古いプロセスからリスニングソケットと接続中のクライアントを受け取る関数である。
+ * すべて受け取れなかったときは、古いプロセスが動き続けるので終了する。
+ */
+static void take_over(int conn) {
+    handoff_record rec;
+    int fd, n = 0, ended = 0;
+
+    sock_listen = INVALID;
+    while (handoff_recv(conn, &fd, &rec, sizeof(rec)) == sizeof(rec)) {
+        if (rec.kind == HANDOFF_END) {
+            /* 受け取り終えたことを知らせると、古いプロセスは終了する */
+            ended = handoff_send(conn, INVALID, NULL, 0) == 0;
+            break;
+        }
+        if (rec.kind == HANDOFF_LISTEN) {
+            sock_listen = fd;
+            continue;
+        }
+
+        int i = alloc_slot(fd);
+        if (i == INVALID) {
+            close(fd);
+            if (handoff_recv_outq(conn, NULL, rec.out_len) == -1) break;
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        Client[i].state = rec.state;
+        Client[i].roster = rec.roster;
+        Client[i].deadline = rec.deadline;
+        Client[i].deficit = 0;
+        memcpy(Client[i].name, rec.name, NAMELENGTH);
+        Client[i].in_len = rec.in_len >= 0 && rec.in_len < BUFLEN ? rec.in_len : 0;
+        memcpy(Client[i].in, rec.in, Client[i].in_len);
+        tb_init(&Client[i].bucket, Rate_limit, Rate_burst);
+        if (rec.state == AWAIT_NAME) {
+            N_awaiting++;
+        } else {
+            N_logged_in++;
+            N_subscriber += rec.roster;
+        }
+        n++;
+        if (handoff_recv_outq(conn, &Client[i].out, rec.out_len) == -1) break;
+    }
+    if (!ended || sock_listen == INVALID) {
+        fprintf(stderr, "Hot upgrade failed: handoff ended early\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Took over %d clients from the old process.\n", n);
+}
+
+/**
+ * 多数の接続を開けるよう、開けるファイル数をハードリミットまで上げる関数である。
+ */
+static void raise_fd_limit() {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
 }
 
 /**
@@ -224,12 +814,24 @@ static void server_loop() {
  * クライアント接続を待ち受ける。
  */
 void chat_server(int port_number, int n_client) {
-    sock_listen = init_tcpserver(port_number, 10);
-    init_client(n_client);
+    /* 接続が集中してもSYNが捨てられないよう、待ち行列は最大にする */
+    raise_fd_limit();
+    /* 切断済みのクライアントへの送信でプロセスが終了しないようにする */
+    signal(SIGPIPE, SIG_IGN);
 
-    FD_ZERO(&master_fds);
-    FD_SET(sock_listen, &master_fds);
-    max_sd = sock_listen;
+    init_client(n_client);
+    int conn;
+    if (Upgrade_path != NULL && (conn = handoff_connect(Upgrade_path)) != -1) {
+        /* 古いプロセスが動いていれば、そのソケットを引き継ぐ */
+        take_over(conn);
+        close(conn);
+    } else {
+        sock_listen = init_tcpserver(port_number, SOMAXCONN);
+    }
+    fcntl(sock_listen, F_SETFL, fcntl(sock_listen, F_GETFL, 0) | O_NONBLOCK);
+    if (Upgrade_path != NULL) {
+        sock_handoff = handoff_server(Upgrade_path);
+    }
 
     server_loop();
 
@@ -320,6 +922,62 @@ void chat_client(char *servername, int port_number)
     }
 }
 
+/**
+ * ログイン処理の性能を測る関数である。観測用のクライアントでログインしたあと、
+ * n_conn個の接続を一斉に開いて名前を送り、全員の入室通知が届くまでの時間を表示する。
+ * サーバは -c で n_conn + 1 以上のクライアント数を指定して起動しておくこと。
+ */
+void login_bench(char *servername, int port_number, int n_conn)
+{
+    int observer, *socks, entered = 0;
+    char buf[BUFLEN], carry[BUFLEN];
+    int carry_len = 0;
+    struct timeval start, end;
+
+    if ((socks = (int *)malloc(n_conn * sizeof(int))) == NULL) {
+        exit_errmesg("malloc()");
+    }
+    raise_fd_limit();
+    observer = init_tcpclient(servername, port_number);
+    Send(observer, "observer", strlen("observer"), 0);
+    usleep(100000); /* 観測用クライアントのログインを先に済ませる */
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < n_conn; i++) {
+        socks[i] = init_tcpclient(servername, port_number);
+        snprintf(buf, NAMELENGTH, "bench%d", i);
+        Send(socks[i], buf, strlen(buf), 0);
+    }
+
+    /* 入室通知を数える (通知はTCP上で分割・結合されることがあるので行単位で数える) */
+    while (entered < n_conn) {
+        int len = Recv(observer, buf, BUFLEN - 1, 0);
+        if (len == 0) {
+            fprintf(stderr, "Server closed the connection after %d logins\n", entered);
+            break;
+        }
+        for (int i = 0; i < len; i++) {
+            if (buf[i] != '\n') {
+                if (carry_len < BUFLEN - 1) carry[carry_len++] = buf[i];
+                continue;
+            }
+            carry[carry_len] = '\0';
+            if (strstr(carry, "has entered the chat.") != NULL) entered++;
+            carry_len = 0;
+        }
+    }
+    gettimeofday(&end, NULL);
+
+    double sec = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%d logins in %.3f sec (%.0f logins/sec)\n", entered, sec, entered / sec);
+
+    for (int i = 0; i < n_conn; i++) {
+        close(socks[i]);
+    }
+    close(observer);
+    free(socks);
+}
+
 /**
  * プログラムのエントリーポイントである。コマンドライン引数を解析し、
  * サーバモードまたはクライアントモードを設定して実行する。
@@ -328,6 +986,7 @@ int main(int argc, char *argv[])
 {
     int port_number = DEFAULT_PORT;
     int num_client = DEFAULT_NCLIENT;
+    int n_conn = 100;
     char servername[SERVER_LEN] = "localhost";
     char mode = DEFAULT_MODE;
     int c;
@@ -335,7 +994,7 @@ int main(int argc, char *argv[])
     /* オプション文字列の取得 */
     opterr = 0;
     while (1) {
-        c = getopt(argc, argv, "SCs:p:c:h");
+        c = getopt(argc, argv, "SCBs:p:c:m:n:r:b:U:h");
         if (c == -1)
             break;
 
@@ -348,6 +1007,10 @@ int main(int argc, char *argv[])
             mode = 'C';
             break;
 
+        case 'B': /* ログイン性能の測定モードにする */
+            mode = 'B';
+            break;
+
         case 's': /* サーバ名の指定 */
             snprintf(servername, SERVER_LEN, "%s", optarg);
             break;
@@ -356,15 +1019,36 @@ int main(int argc, char *argv[])
             port_number = atoi(optarg);
             break;
 
-        case 'c': /* クライアントの数 */
+        case 'c': /* クライアントの数 (ソフトリミット) */
             num_client = atoi(optarg);
             break;
 
+        case 'm': /* クライアントの数のハードリミット */
+            Max_client = atoi(optarg);
+            break;
+
+        case 'U': /* 無停止入れ替えに使うUnixソケットのパス */
+            Upgrade_path = optarg;
+            break;
+
+        case 'n': /* 測定モードで開く接続の数 */
+            n_conn = atoi(optarg);
+            break;
+
+        case 'r': /* クライアントごとの1秒あたりのメッセージ数の上限 */
+            Rate_limit = atof(optarg);
+            break;
+
+        case 'b': /* 流量制限のバースト */
+            Rate_burst = atof(optarg);
+            break;
+
         case '?':
             fprintf(stderr, "Unknown option '%c'\n", optopt);
         case 'h':
-            fprintf(stderr, "Usage(Server): %s -S -p port_number -c num_client\n", argv[0]);
+            fprintf(stderr, "Usage(Server): %s -S -p port_number -c num_client [-m max_client] [-r rate] [-b burst] [-U upgrade_path]\n", argv[0]);
             fprintf(stderr, "Usage(Client): %s -C -s server_name -p port_number\n", argv[0]);
+            fprintf(stderr, "Usage(Bench):  %s -B -s server_name -p port_number -n connections\n", argv[0]);
             exit(EXIT_FAILURE);
             break;
         }
@@ -377,6 +1061,9 @@ int main(int argc, char *argv[])
     case 'C':
         chat_client(servername, port_number);
         break;
+    case 'B':
+        login_bench(servername, port_number, n_conn);
+        break;
     }
 
     exit(EXIT_SUCCESS);
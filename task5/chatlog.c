@@ -0,0 +1,361 @@
+/*
+  chatlog.c
+  ステージングバッファは単一生産者(メインループ)・単一消費者(書き込みスレッド)の
+  リングバッファで、head/tailをアトミック変数で受け渡すだけなのでロックを取らない。
+*/
+
+#include "chatlog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define RING_SIZE (1 << 20) /* ステージングバッファのサイズ (2の冪) */
+#define RING_MASK (RING_SIZE - 1)
+#define BATCH_SIZE (256 * 1024) /* 1回のwriteでまとめて書き込むサイズ */
+#define MAX_RECORD (BATCH_SIZE - sizeof(chatlog_record)) /* ヘッダを付けても1回のバッチに収まる長さ */
+#define IDLE_WAIT_US 1000 /* バッファが空のときの待ち時間 */
+#define PATHLEN 1024
+
+/* リング上のレコードヘッダ */
+typedef struct {
+    uint32_t len;
+    uint64_t usec;
+} ring_header;
+
+static char Ring[RING_SIZE];
+static _Atomic size_t Head; /* 生産者だけが進める */
+static _Atomic size_t Tail; /* 消費者だけが進める */
+static _Atomic uint64_t Dropped;
+static atomic_int Stop;
+
+static char Dir[PATHLEN];
+static int Sync_ms;
+static int Log_fd = -1;
+static unsigned Segment; /* 現在のセグメント番号 */
+static size_t Segment_bytes;
+static uint64_t Seq;
+static char *Batch;
+static pthread_t Writer;
+static int Running;
+
+static uint64_t now_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void ring_put(size_t pos, const void *src, size_t n) {
+    size_t off = pos & RING_MASK;
+    size_t first = RING_SIZE - off < n ? RING_SIZE - off : n;
+    memcpy(Ring + off, src, first);
+    memcpy(Ring, (const char *)src + first, n - first);
+}
+
+static void ring_get(size_t pos, void *dst, size_t n) {
+    size_t off = pos & RING_MASK;
+    size_t first = RING_SIZE - off < n ? RING_SIZE - off : n;
+    memcpy(dst, Ring + off, first);
+    memcpy((char *)dst + first, Ring, n - first);
+}
+
+void chatlog_append(const char *msg, size_t len) {
+    ring_header h;
+    size_t head, tail;
+
+    if (!Running) return;
+    if (len > MAX_RECORD) len = MAX_RECORD;
+
+    head = atomic_load_explicit(&Head, memory_order_relaxed);
+    tail = atomic_load_explicit(&Tail, memory_order_acquire);
+    if (RING_SIZE - (head - tail) < sizeof(h) + len) {
+        // 書き込みが追いつかない場合でも、ブロードキャストは待たせない
+        atomic_fetch_add_explicit(&Dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    h.len = (uint32_t)len;
+    h.usec = now_usec();
+    ring_put(head, &h, sizeof(h));
+    ring_put(head + sizeof(h), msg, len);
+    atomic_store_explicit(&Head, head + sizeof(h) + len, memory_order_release);
+}
+
+uint64_t chatlog_dropped(void) {
+    return atomic_load_explicit(&Dropped, memory_order_relaxed);
+}
+
+static int segment_path(char *path, size_t size, unsigned index) {
+    return snprintf(path, size, "%s/chat-%08u.log", Dir, index);
+}
+
+static int is_segment(const char *name, unsigned *index) {
+    char tail;
+    return sscanf(name, "chat-%8u.lo%c", index, &tail) == 2 && tail == 'g';
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t r = write(fd, buf, len);
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int open_segment(void) {
+    char path[PATHLEN];
+
+    if (Log_fd != -1) {
+        fdatasync(Log_fd);
+        close(Log_fd);
+    }
+    Segment++;
+    segment_path(path, sizeof(path), Segment);
+    if ((Log_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644)) == -1) {
+        perror(path);
+        return -1;
+    }
+    Segment_bytes = 0;
+    return 0;
+}
+
+static void flush_batch(size_t len) {
+    if (len == 0 || Log_fd == -1) return;
+    if (write_all(Log_fd, Batch, len) == -1) {
+        perror("chatlog write");
+    }
+    Segment_bytes += len;
+}
+
+/* リングからバッチへレコードを移し、まとめて書き込む。移したレコード数を返す */
+static int drain(void) {
+    size_t tail = atomic_load_explicit(&Tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&Head, memory_order_acquire);
+    size_t batch_len = 0;
+    int n = 0;
+
+    while (tail != head) {
+        ring_header h;
+        chatlog_record rec;
+
+        ring_get(tail, &h, sizeof(h));
+        if (batch_len + sizeof(rec) + h.len > BATCH_SIZE) {
+            flush_batch(batch_len);
+            batch_len = 0;
+        }
+        if (Segment_bytes + batch_len >= CHATLOG_SEGMENT_SIZE) {
+            flush_batch(batch_len);
+            batch_len = 0;
+            open_segment();
+        }
+
+        rec.magic = CHATLOG_MAGIC;
+        rec.len = h.len;
+        rec.seq = ++Seq;
+        rec.usec = h.usec;
+        memcpy(Batch + batch_len, &rec, sizeof(rec));
+        ring_get(tail + sizeof(h), Batch + batch_len + sizeof(rec), h.len);
+        batch_len += sizeof(rec) + h.len;
+
+        tail += sizeof(h) + h.len;
+        atomic_store_explicit(&Tail, tail, memory_order_release);
+        n++;
+    }
+    flush_batch(batch_len);
+    return n;
+}
+
+static void *writer_thread(void *arg) {
+    uint64_t last_sync = now_usec();
+    int dirty = 0;
+    struct timespec idle = {0, IDLE_WAIT_US * 1000};
+
+    (void)arg;
+    for (;;) {
+        int stopping = atomic_load(&Stop);
+        if (drain() > 0) {
+            dirty = 1;
+        } else if (!stopping) {
+            nanosleep(&idle, NULL);
+        }
+
+        // グループコミット: 間隔内に書いたすべてのレコードを1回のfdatasyncで確定する
+        if (dirty && (stopping || now_usec() - last_sync >= (uint64_t)Sync_ms * 1000)) {
+            if (fdatasync(Log_fd) == -1) {
+                perror("fdatasync");
+            }
+            last_sync = now_usec();
+            dirty = 0;
+        }
+        if (stopping && atomic_load_explicit(&Head, memory_order_acquire) ==
+                        atomic_load_explicit(&Tail, memory_order_relaxed)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void last_seq_callback(const chatlog_record *rec, const char *msg, void *arg) {
+    (void)msg;
+    *(uint64_t *)arg = rec->seq;
+}
+
+/* セグメントを1つmmapしてレコードを順にたどる */
+static long replay_segment(const char *path, chatlog_callback cb, void *arg) {
+    struct stat st;
+    const char *map, *p, *end;
+    long n = 0;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        perror(path);
+        return 0;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 0;
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+    p = map;
+    end = map + st.st_size;
+    while ((size_t)(end - p) >= sizeof(chatlog_record)) {
+        chatlog_record rec;
+        memcpy(&rec, p, sizeof(rec));
+        // 書きかけ(クラッシュ時)のレコードに達したら打ち切る
+        if (rec.magic != CHATLOG_MAGIC || rec.len > (size_t)(end - p) - sizeof(rec)) {
+            break;
+        }
+        cb(&rec, p + sizeof(rec), arg);
+        p += sizeof(rec) + rec.len;
+        n++;
+    }
+    munmap((void *)map, st.st_size);
+    return n;
+}
+
+static int compare_unsigned(const void *a, const void *b) {
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return (x > y) - (x < y);
+}
+
+/* dir 内のセグメント番号を昇順で返す。dir を開けなければ count を-1にする */
+static unsigned *list_segments(const char *dir, int *count) {
+    DIR *dp;
+    struct dirent *ent;
+    unsigned *list = NULL, index;
+    int n = 0, cap = 0;
+
+    *count = 0;
+    if ((dp = opendir(dir)) == NULL) {
+        perror(dir);
+        *count = -1;
+        return NULL;
+    }
+    while ((ent = readdir(dp)) != NULL) {
+        if (!is_segment(ent->d_name, &index)) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            if ((list = realloc(list, cap * sizeof(unsigned))) == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        list[n++] = index;
+    }
+    closedir(dp);
+    qsort(list, n, sizeof(unsigned), compare_unsigned);
+    *count = n;
+    return list;
+}
+
+long chatlog_replay(const char *dir, chatlog_callback cb, void *arg) {
+    char path[PATHLEN];
+    unsigned *list;
+    long total = 0;
+    int n;
+
+    // ディレクトリがなければ失敗、セグメントがなければ0件
+    if ((list = list_segments(dir, &n)) == NULL) {
+        return n < 0 ? -1 : 0;
+    }
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/chat-%08u.log", dir, list[i]);
+        total += replay_segment(path, cb, arg);
+    }
+    free(list);
+    return total;
+}
+
+int chatlog_open(const char *dir, int sync_ms) {
+    unsigned *list;
+    int n;
+
+    snprintf(Dir, sizeof(Dir), "%s", dir);
+    Sync_ms = sync_ms > 0 ? sync_ms : CHATLOG_DEFAULT_SYNC_MS;
+    if (mkdir(Dir, 0755) == -1 && errno != EEXIST) {
+        perror(Dir);
+        return -1;
+    }
+
+    // 既存のセグメントは上書きせず、その次の番号から書き始める
+    Segment = 0;
+    Seq = 0;
+    if ((list = list_segments(Dir, &n)) != NULL) {
+        char path[PATHLEN];
+        Segment = list[n - 1];
+        segment_path(path, sizeof(path), Segment);
+        replay_segment(path, last_seq_callback, &Seq);
+        free(list);
+    }
+
+    if ((Batch = malloc(BATCH_SIZE)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (open_segment() == -1) {
+        free(Batch);
+        return -1;
+    }
+
+    atomic_store(&Stop, 0);
+    if (pthread_create(&Writer, NULL, writer_thread, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    Running = 1;
+    return 0;
+}
+
+void chatlog_close(void) {
+    if (!Running) return;
+    Running = 0;
+    atomic_store(&Stop, 1);
+    pthread_join(Writer, NULL);
+    close(Log_fd);
+    Log_fd = -1;
+    free(Batch);
+    if (chatlog_dropped() > 0) {
+        fprintf(stderr, "chatlog: %llu messages dropped\n", (unsigned long long)chatlog_dropped());
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef CHATLOG_H_
+#define CHATLOG_H_
+/*
+  chatlog.h
+  追記専用のチャットログ。ブロードキャスト側はロックフリーのステージングバッファに
+  コピーするだけで、ディスクへの書き込みとfdatasyncはバックグラウンドスレッドが行う。
+*/
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHATLOG_MAGIC 0x474c4354u /* "TCLG" */
+#define CHATLOG_SEGMENT_SIZE (16 * 1024 * 1024) /* セグメントの切り替えサイズ */
+#define CHATLOG_DEFAULT_SYNC_MS 50 /* グループコミット間隔の既定値 */
+
+/* セグメントファイル上のレコードヘッダ (直後にlenバイトの本文が続く) */
+typedef struct {
+    uint32_t magic;
+    uint32_t len;
+    uint64_t seq;
+    uint64_t usec; /* 受信時刻 (UNIX時刻、マイクロ秒) */
+} chatlog_record;
+
+typedef void (*chatlog_callback)(const chatlog_record *rec, const char *msg, void *arg);
+
+/* ログディレクトリ dir に新しいセグメントを作り、書き込みスレッドを起動する */
+int chatlog_open(const char *dir, int sync_ms);
+
+/* メッセージをステージングバッファにコピーする。満杯の場合は破棄して数える */
+void chatlog_append(const char *msg, size_t len);
+
+/* 残りを書き出してfdatasyncし、書き込みスレッドを終了する */
+void chatlog_close(void);
+
+/* 破棄されたメッセージ数 */
+uint64_t chatlog_dropped(void);
+
+/* dir のセグメントを順にmmapし、各レコードについて cb を呼ぶ。レコード数 (dir を開けなければ-1) を返す */
+long chatlog_replay(const char *dir, chatlog_callback cb, void *arg);
+
+#endif /* CHATLOG_H_ */
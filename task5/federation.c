@@ -0,0 +1,463 @@
+/*
+  federation.c
+*/
+
+#include "task5.h"
+#include "federation.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#define LINK_BUFLEN 4096
+#define MAX_ORIGINS 64
+#define DEDUP_WINDOW 64 /* seqの追い越しを許す幅 */
+
+/* サーバ間リンク */
+typedef struct {
+    int sock;
+    uint32_t id;
+    int connecting; /* ノンブロッキングのconnectが終わるのを待っている */
+    outq out;       /* 送り切れなかった行 (接続中はLINKの行) */
+    char inbuf[LINK_BUFLEN];
+    int inlen;
+} peer_link;
+
+/* 発信元サーバごとの受信済みseq (max_seqから遡ってDEDUP_WINDOW件をビットで覚える) */
+typedef struct {
+    uint32_t id;
+    uint64_t max_seq;
+    uint64_t window;
+} origin_state;
+
+/* 無停止入れ替えで渡すサーバの状態 (直後にリンクの数だけ link_record が続く) */
+typedef struct {
+    uint32_t id;
+    uint64_t seq;
+    int n_origin;
+    origin_state origin[MAX_ORIGINS];
+    int n_link;
+} state_record;
+
+/* 無停止入れ替えで渡すリンク (直後に送信キューの未送信分 outlen バイトが続く) */
+typedef struct {
+    uint32_t id;
+    int connecting;
+    int inlen;
+    char inbuf[LINK_BUFLEN];
+    size_t outlen;
+} link_record;
+
+static peer_link Peer[MAX_PEERS];
+static origin_state Origin[MAX_ORIGINS];
+static int N_origin;
+static uint32_t My_id;
+static in_port_t My_port;
+static uint64_t My_seq;
+static int Taken_over; /* IDは古いプロセスから受け取った */
+static time_t Last_announce;
+static struct sockaddr_in Announce_adrs;
+
+uint32_t federation_id(void) {
+    return My_id;
+}
+
+/* (origin, seq) を受信済みにする。既に受信済みなら1を返す */
+static int already_seen(uint32_t origin, uint64_t seq) {
+    origin_state *o = NULL;
+
+    for (int i = 0; i < N_origin; i++) {
+        if (Origin[i].id == origin) {
+            o = &Origin[i];
+            break;
+        }
+    }
+    if (o == NULL) {
+        // 表が一杯ならハッシュ位置の発信元を追い出す
+        o = &Origin[N_origin < MAX_ORIGINS ? N_origin++ : (int)(origin % MAX_ORIGINS)];
+        o->id = origin;
+        o->max_seq = seq;
+        o->window = 1;
+        return 0;
+    }
+
+    if (seq > o->max_seq) {
+        uint64_t shift = seq - o->max_seq;
+        o->window = shift >= DEDUP_WINDOW ? 1 : (o->window << shift) | 1;
+        o->max_seq = seq;
+        return 0;
+    }
+    uint64_t age = o->max_seq - seq;
+    if (age >= DEDUP_WINDOW || (o->window & (1ULL << age))) {
+        return 1;
+    }
+    o->window |= 1ULL << age;
+    return 0;
+}
+
+static peer_link *find_peer(uint32_t id) {
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (Peer[i].sock > 0 && Peer[i].id == id) {
+            return &Peer[i];
+        }
+    }
+    return NULL;
+}
+
+static peer_link *add_peer(int sock, uint32_t id) {
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (Peer[i].sock == 0) {
+            Peer[i].sock = sock;
+            Peer[i].id = id;
+            Peer[i].connecting = 0;
+            Peer[i].inlen = 0;
+            memset(&Peer[i].out, 0, sizeof(outq));
+            return &Peer[i];
+        }
+    }
+    return NULL;
+}
+
+static void drop_peer(peer_link *p) {
+    printf("Lost link with server %08x\n", p->id);
+    close(p->sock);
+    p->sock = 0;
+    outq_clear(&p->out);
+}
+
+/* 送信キューに入れて送れるだけ送る。残りはソケットが空いたときに federation_poll が送る */
+static void send_line(peer_link *p, outmsg *m) {
+    if (outq_push(&p->out, m, outq_now()) == -1) {
+        fprintf(stderr, "Server %08x is too slow to receive\n", p->id);
+        drop_peer(p);
+        return;
+    }
+    if (!p->connecting && !p->out.blocked && outq_flush(p->sock, &p->out) == -1) {
+        perror("send to peer");
+        drop_peer(p);
+    }
+}
+
+/* from 以外のすべてのリンクへ1行を送る (キューでは1つのバッファを共有する) */
+static void relay_line(const char *line, size_t len, peer_link *from) {
+    outmsg *m = outmsg_bytes(line, len);
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (Peer[i].sock > 0 && &Peer[i] != from) {
+            send_line(&Peer[i], m);
+        }
+    }
+    outmsg_release(m);
+}
+
+static void announce(int udp_sock) {
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "PEER %08x %u", My_id, My_port);
+    if (sendto(udp_sock, buf, len, 0, (struct sockaddr *)&Announce_adrs, sizeof(Announce_adrs)) == -1) {
+        perror("sendto(PEER)");
+    }
+    Last_announce = time(NULL);
+}
+
+int federation_init(in_port_t udp_port, in_port_t tcp_port) {
+    struct sockaddr_in my_adrs;
+    int sock, on = 1;
+
+    srandom(getpid() ^ time(NULL) ^ tcp_port);
+    if (!Taken_over) {
+        My_id = (uint32_t)random();
+    }
+    My_port = tcp_port;
+    signal(SIGPIPE, SIG_IGN);
+
+    // 同じホスト上の複数のサーバがHELO/PEERを受信できるようにポートを共有する
+    if ((sock = socket(PF_INET, SOCK_DGRAM, 0)) == -1) {
+        exit_errmesg("socket()");
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+    setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+
+    memset(&my_adrs, 0, sizeof(my_adrs));
+    my_adrs.sin_family = AF_INET;
+    my_adrs.sin_port = htons(udp_port);
+    my_adrs.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr *)&my_adrs, sizeof(my_adrs)) == -1) {
+        exit_errmesg("bind()");
+    }
+
+    set_sockaddr_in_broadcast(&Announce_adrs, udp_port);
+    printf("Federated server %08x on port %u\n", My_id, My_port);
+    announce(sock);
+    return sock;
+}
+
+int federation_tick(int udp_sock) {
+    time_t elapsed = time(NULL) - Last_announce;
+    if (elapsed >= PEER_ANNOUNCE_SEC) {
+        announce(udp_sock);
+        return PEER_ANNOUNCE_SEC;
+    }
+    return PEER_ANNOUNCE_SEC - elapsed;
+}
+
+/* selectのループを止めないよう、ノンブロッキングで接続を始める。接続はソケットが書き込み可能になったら確かめる */
+static void connect_peer(struct in_addr addr, in_port_t port, uint32_t id) {
+    struct sockaddr_in adrs;
+    char buf[64];
+    peer_link *p;
+    outmsg *m;
+    int sock, len;
+
+    memset(&adrs, 0, sizeof(adrs));
+    adrs.sin_family = AF_INET;
+    adrs.sin_port = htons(port);
+    adrs.sin_addr = addr;
+
+    if ((sock = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        return;
+    }
+    set_nonblocking(sock);
+    if (connect(sock, (struct sockaddr *)&adrs, sizeof(adrs)) == -1 && errno != EINPROGRESS) {
+        perror("connect to peer");
+        close(sock);
+        return;
+    }
+    if ((p = add_peer(sock, id)) == NULL) {
+        close(sock);
+        return;
+    }
+    p->connecting = 1;
+    len = snprintf(buf, sizeof(buf), "LINK %08x %u\n", My_id, My_port);
+    m = outmsg_bytes(buf, len);
+    send_line(p, m);
+    outmsg_release(m);
+}
+
+/* 接続が終わったリンクを使えるようにする。失敗していればリンクを捨てる */
+static void finish_connect(peer_link *p) {
+    int err;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(p->sock, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+        fprintf(stderr, "connect to peer %08x: %s\n", p->id, strerror(err ? err : errno));
+        close(p->sock);
+        p->sock = 0;
+        outq_clear(&p->out);
+        return;
+    }
+    p->connecting = 0;
+    printf("Linked with server %08x (socket %d)\n", p->id, p->sock);
+}
+
+int federation_handle_udp(int udp_sock, const char *buf, struct sockaddr_in *from) {
+    unsigned id, port;
+
+    if (sscanf(buf, "PEER %x %u", &id, &port) != 2) {
+        return 0;
+    }
+    if (id == My_id || find_peer(id) != NULL) {
+        return 1;
+    }
+
+    if (My_id < id) {
+        connect_peer(from->sin_addr, (in_port_t)port, id);
+    } else if (time(NULL) != Last_announce) {
+        // 相手から接続してもらうため、すぐに自分を告知する
+        // (同じホストではUDPポートを共有しているので、ユニキャストの返信は相手に届くとは限らない)
+        announce(udp_sock);
+    }
+    return 1;
+}
+
+/* リンクから受信した1行を処理する */
+static void handle_line(peer_link *p, char *line, federation_deliver deliver, void *arg) {
+    unsigned origin;
+    unsigned long long seq;
+    int offset;
+
+    if (sscanf(line, "MSG %x %llu %n", &origin, &seq, &offset) != 2) {
+        return;
+    }
+    if (already_seen(origin, seq)) {
+        return;
+    }
+    deliver(line + offset, arg);
+
+    // 部分的なメッシュでも届くように、受け取ったリンク以外へ転送する
+    size_t len = strlen(line);
+    line[len] = '\n';
+    relay_line(line, len + 1, p);
+    line[len] = '\0';
+}
+
+static void consume(peer_link *p, federation_deliver deliver, void *arg) {
+    char *start = p->inbuf, *nl;
+
+    while ((nl = memchr(start, '\n', p->inbuf + p->inlen - start)) != NULL) {
+        *nl = '\0';
+        handle_line(p, start, deliver, arg);
+        if (p->sock == 0) return;
+        start = nl + 1;
+    }
+    p->inlen -= start - p->inbuf;
+    memmove(p->inbuf, start, p->inlen);
+    if (p->inlen == LINK_BUFLEN) {
+        // 改行のない長すぎる行は捨てる
+        p->inlen = 0;
+    }
+}
+
+void federation_adopt(int sock, const char *buf, federation_deliver deliver, void *arg) {
+    unsigned id, port;
+    const char *rest;
+    peer_link *p;
+
+    if (sscanf(buf, "LINK %x %u", &id, &port) != 2 || id == My_id || find_peer(id) != NULL ||
+        (p = add_peer(sock, id)) == NULL) {
+        close(sock);
+        return;
+    }
+    printf("Linked with server %08x (socket %d)\n", id, sock);
+
+    // LINKと同じパケットで届いたMSGを取りこぼさない
+    if ((rest = strchr(buf, '\n')) != NULL) {
+        rest++;
+        p->inlen = snprintf(p->inbuf, LINK_BUFLEN, "%s", rest);
+        if (p->inlen >= LINK_BUFLEN) p->inlen = LINK_BUFLEN - 1;
+        consume(p, deliver, arg);
+    }
+}
+
+int federation_fdset(fd_set *rfds, fd_set *wfds, int maxfd) {
+    for (int i = 0; i < MAX_PEERS; i++) {
+        peer_link *p = &Peer[i];
+        if (p->sock <= 0) continue;
+        if (p->connecting || p->out.blocked) {
+            FD_SET(p->sock, wfds);
+        }
+        if (!p->connecting) {
+            FD_SET(p->sock, rfds);
+        }
+        if (p->sock > maxfd) maxfd = p->sock;
+    }
+    return maxfd;
+}
+
+void federation_poll(fd_set *rfds, fd_set *wfds, federation_deliver deliver, void *arg) {
+    for (int i = 0; i < MAX_PEERS; i++) {
+        peer_link *p = &Peer[i];
+        if (p->sock <= 0) continue;
+
+        if (FD_ISSET(p->sock, wfds)) {
+            if (p->connecting) {
+                finish_connect(p);
+                if (p->sock == 0) continue;
+            }
+            if (outq_flush(p->sock, &p->out) == -1) {
+                perror("send to peer");
+                drop_peer(p);
+                continue;
+            }
+        }
+        if (!FD_ISSET(p->sock, rfds)) continue;
+
+        int n = recv(p->sock, p->inbuf + p->inlen, LINK_BUFLEN - p->inlen, 0);
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            drop_peer(p);
+            continue;
+        }
+        p->inlen += n;
+        consume(p, deliver, arg);
+    }
+}
+
+void federation_publish(const char *msg) {
+    char line[BUFSIZE + 64];
+    int len;
+
+    My_seq++;
+    already_seen(My_id, My_seq);
+    len = snprintf(line, sizeof(line) - 1, "MSG %08x %llu %s", My_id, (unsigned long long)My_seq, msg);
+    if (len > (int)sizeof(line) - 2) len = sizeof(line) - 2;
+    // 行区切りなので本文中の改行は空白に置き換える
+    for (int i = 0; i < len; i++) {
+        if (line[i] == '\n' || line[i] == '\r') line[i] = ' ';
+    }
+    line[len++] = '\n';
+    relay_line(line, len, NULL);
+}
+
+int federation_hand_off(int conn) {
+    state_record st;
+    link_record rec;
+
+    memset(&st, 0, sizeof(st));
+    st.id = My_id;
+    st.seq = My_seq;
+    st.n_origin = N_origin;
+    memcpy(st.origin, Origin, sizeof(Origin));
+    for (int i = 0; i < MAX_PEERS; i++) {
+        st.n_link += Peer[i].sock > 0;
+    }
+    if (handoff_send(conn, -1, &st, sizeof(st)) == -1) {
+        return -1;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    for (int i = 0; i < MAX_PEERS; i++) {
+        peer_link *p = &Peer[i];
+        if (p->sock <= 0) continue;
+        rec.id = p->id;
+        rec.connecting = p->connecting;
+        rec.inlen = p->inlen;
+        memcpy(rec.inbuf, p->inbuf, p->inlen);
+        rec.outlen = p->out.bytes;
+        if (handoff_send(conn, p->sock, &rec, sizeof(rec)) == -1 || handoff_send_outq(conn, &p->out) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int federation_take_over(int conn) {
+    state_record st;
+    link_record rec;
+    peer_link *p;
+    int fd, n = 0;
+
+    if (handoff_recv(conn, &fd, &st, sizeof(st)) != sizeof(st) || st.n_origin < 0 || st.n_origin > MAX_ORIGINS) {
+        return -1;
+    }
+    // 他のサーバからは同じサーバに見えるよう、IDとseq、重複除去の状態を続けて使う
+    My_id = st.id;
+    My_seq = st.seq;
+    N_origin = st.n_origin;
+    memcpy(Origin, st.origin, sizeof(Origin));
+    Taken_over = 1;
+
+    for (int k = 0; k < st.n_link; k++) {
+        if (handoff_recv(conn, &fd, &rec, sizeof(rec)) != sizeof(rec) || fd == -1) {
+            return -1;
+        }
+        if ((p = add_peer(fd, rec.id)) == NULL) {
+            close(fd);
+            if (handoff_recv_outq(conn, NULL, rec.outlen) == -1) return -1;
+            continue;
+        }
+        set_nonblocking(fd);
+        p->connecting = rec.connecting;
+        p->inlen = rec.inlen >= 0 && rec.inlen < LINK_BUFLEN ? rec.inlen : 0;
+        memcpy(p->inbuf, rec.inbuf, p->inlen);
+        if (handoff_recv_outq(conn, &p->out, rec.outlen) == -1) {
+            return -1;
+        }
+        p->out.blocked = p->out.count > 0; // 書き込み可能になったら送る
+        n++;
+    }
+    printf("Took over %d links as server %08x\n", n, My_id);
+    return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef FEDERATION_H_
+#define FEDERATION_H_
+/*
+  federation.h
+  サーバ間リンクによるチャットルームの連合。
+  サーバ同士はHELO/HEREと同じUDPポートで "PEER <id> <port>" を告知し合い、
+  IDの小さい側が相手のTCPポートへ接続して "LINK <id> <port>" を送る。
+  リンク上では "MSG <origin> <seq> <text>" を改行区切りで中継し、(origin, seq) で重複を除く。
+*/
+#include "mynet.h"
+#include <stdint.h>
+#include <sys/select.h>
+
+#define MAX_PEERS 16
+#define PEER_ANNOUNCE_SEC 5 /* PEER告知の間隔 */
+
+/* 中継されてきたメッセージをローカルのクライアントへ配るコールバック */
+typedef void (*federation_deliver)(const char *msg, void *arg);
+
+/* 連合モードを初期化し、他のサーバと共有できるUDPソケットを返す */
+int federation_init(in_port_t udp_port, in_port_t tcp_port);
+
+/* このサーバのID */
+uint32_t federation_id(void);
+
+/* 一定間隔でPEERをブロードキャストする。次の告知までの秒数を返す */
+int federation_tick(int udp_sock);
+
+/* UDPで受信したPEERを処理する。PEERでなければ0を返す */
+int federation_handle_udp(int udp_sock, const char *buf, struct sockaddr_in *from);
+
+/* クライアントとして受け付けたソケットがLINKを送ってきたとき、リンクとして引き取る */
+void federation_adopt(int sock, const char *buf, federation_deliver deliver, void *arg);
+
+/* リンクのソケットを rfds に、接続中や送り残しのあるリンクを wfds に加え、最大のディスクリプタを返す */
+int federation_fdset(fd_set *rfds, fd_set *wfds, int maxfd);
+
+/* 接続の完了と送り残しの送信を行い、受信したメッセージのうち初めて見るものを
+   deliver に渡して他のリンクへ中継する */
+void federation_poll(fd_set *rfds, fd_set *wfds, federation_deliver deliver, void *arg);
+
+/* ローカルで発生したメッセージに新しいIDを振ってすべてのリンクへ送る */
+void federation_publish(const char *msg);
+
+/* 無停止入れ替えで、サーバのIDと重複除去の状態、リンク (送り残しを含む) を conn で渡す。失敗すれば-1 */
+int federation_hand_off(int conn);
+
+/* federation_hand_off() が渡したものを受け取る。federation_init() より前に呼ぶ */
+int federation_take_over(int conn);
+
+#endif /* FEDERATION_H_ */
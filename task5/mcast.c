@@ -0,0 +1,263 @@
+/*
+  mcast.c
+*/
+
+#include "task5.h"
+#include "mcast.h"
+#include <arpa/inet.h>
+#include <time.h>
+
+/* サーバ側: 再送用の履歴 */
+typedef struct {
+    uint64_t seq;
+    int slot;
+    char *msg;
+} history_entry;
+
+/* クライアント側: 並べ替え待ちのメッセージ */
+typedef struct {
+    uint64_t seq;
+    int slot;
+    int lost;
+    char msg[BUFSIZE];
+} pending_entry;
+
+static int Send_sock = -1;
+static struct sockaddr_in Group_adrs;
+static uint64_t Next_seq = 1;
+static history_entry History[MCAST_HISTORY];
+static time_t Last_beacon;
+
+static uint64_t Next; /* 次に表示するseq (0はMCSTART待ち) */
+static uint64_t Nacked; /* NACK済みか受信済みの最大seq */
+static int My_slot = -1;
+static pending_entry Pending[MCAST_WINDOW];
+
+static struct in_addr iface_addr(const char *iface) {
+    struct in_addr addr;
+    if (iface == NULL || inet_aton(iface, &addr) == 0) {
+        addr.s_addr = htonl(INADDR_ANY);
+    }
+    return addr;
+}
+
+int mcast_server_init(const char *group, in_port_t port, const char *iface) {
+    struct in_addr addr = iface_addr(iface);
+    unsigned char ttl = 1, loop = 1;
+
+    memset(&Group_adrs, 0, sizeof(Group_adrs));
+    Group_adrs.sin_family = AF_INET;
+    Group_adrs.sin_port = htons(port);
+    if (inet_aton(group, &Group_adrs.sin_addr) == 0 || !IN_MULTICAST(ntohl(Group_adrs.sin_addr.s_addr))) {
+        fprintf(stderr, "Invalid multicast group: %s\n", group);
+        return -1;
+    }
+
+    Send_sock = init_udpclient();
+    // LAN内だけに届け、同じホストのクライアントにも配る
+    setsockopt(Send_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(Send_sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    if (addr.s_addr != htonl(INADDR_ANY) &&
+        setsockopt(Send_sock, IPPROTO_IP, IP_MULTICAST_IF, &addr, sizeof(addr)) == -1) {
+        perror("setsockopt(IP_MULTICAST_IF)");
+        return -1;
+    }
+    printf("Multicast delivery to %s:%u\n", group, port);
+    return Send_sock;
+}
+
+int mcast_announce(char *buf, size_t size, int slot) {
+    return snprintf(buf, size, "MCST %s %u %d", inet_ntoa(Group_adrs.sin_addr), ntohs(Group_adrs.sin_port), slot);
+}
+
+int mcast_start(char *buf, size_t size) {
+    // これより前のseqはTCPで送り済み、これ以降はグループにだけ送る
+    return snprintf(buf, size, "MCSTART %llu", (unsigned long long)Next_seq);
+}
+
+uint64_t mcast_send(const char *msg, int from_slot) {
+    char datagram[BUFSIZE + 64];
+    uint64_t seq = Next_seq++;
+    history_entry *h = &History[seq % MCAST_HISTORY];
+
+    free(h->msg);
+    h->seq = seq;
+    h->slot = from_slot;
+    h->msg = strdup(msg);
+
+    int len = snprintf(datagram, sizeof(datagram), "SEQ %llu %d %s", (unsigned long long)seq, from_slot, msg);
+    if (len >= (int)sizeof(datagram)) len = sizeof(datagram) - 1;
+    // 失敗しても履歴には残っているので、クライアントのNACKで回復できる
+    if (sendto(Send_sock, datagram, len, 0, (struct sockaddr *)&Group_adrs, sizeof(Group_adrs)) == -1) {
+        perror("sendto(multicast)");
+    }
+    return seq;
+}
+
+int mcast_tick(void) {
+    char beacon[64];
+    time_t elapsed = time(NULL) - Last_beacon;
+
+    if (elapsed < MCAST_BEACON_SEC) {
+        return MCAST_BEACON_SEC - elapsed;
+    }
+    // 最後のメッセージが落ちても、クライアントはこれを見てNACKできる
+    if (Next_seq > 1) {
+        int len = snprintf(beacon, sizeof(beacon), "LAST %llu", (unsigned long long)(Next_seq - 1));
+        if (sendto(Send_sock, beacon, len, 0, (struct sockaddr *)&Group_adrs, sizeof(Group_adrs)) == -1) {
+            perror("sendto(multicast)");
+        }
+    }
+    Last_beacon = time(NULL);
+    return MCAST_BEACON_SEC;
+}
+
+uint64_t mcast_next_seq(void) {
+    return Next_seq;
+}
+
+void mcast_resume(uint64_t next_seq) {
+    Next_seq = next_seq;
+}
+
+void mcast_retransmit(uint64_t from, uint64_t to, void (*out)(const char *line, void *arg), void *arg) {
+    char line[BUFSIZE + 64];
+
+    if (to >= Next_seq) to = Next_seq - 1;
+    if (from + MCAST_HISTORY <= to) from = to - MCAST_HISTORY + 1;
+    for (uint64_t seq = from; seq <= to && seq > 0; seq++) {
+        history_entry *h = &History[seq % MCAST_HISTORY];
+        if (h->seq == seq && h->msg != NULL) {
+            snprintf(line, sizeof(line), "RTX %llu %d %s", (unsigned long long)seq, h->slot, h->msg);
+        } else {
+            snprintf(line, sizeof(line), "LOST %llu", (unsigned long long)seq);
+        }
+        out(line, arg);
+    }
+}
+
+int mcast_client_join(const char *announce, const char *iface) {
+    char group[INET_ADDRSTRLEN];
+    unsigned port;
+    struct ip_mreq mreq;
+    struct sockaddr_in my_adrs;
+    int sock, on = 1;
+
+    if (sscanf(announce, "MCST %15s %u %d", group, &port, &My_slot) != 3) {
+        return -1;
+    }
+
+    sock = init_udpclient();
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+    memset(&my_adrs, 0, sizeof(my_adrs));
+    my_adrs.sin_family = AF_INET;
+    my_adrs.sin_port = htons(port);
+    my_adrs.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr *)&my_adrs, sizeof(my_adrs)) == -1) {
+        perror("bind(multicast)");
+        close(sock);
+        return -1;
+    }
+
+    memset(&mreq, 0, sizeof(mreq));
+    inet_aton(group, &mreq.imr_multiaddr);
+    mreq.imr_interface = iface_addr(iface);
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1) {
+        perror("setsockopt(IP_ADD_MEMBERSHIP)");
+        close(sock);
+        return -1;
+    }
+
+    Next = 0;
+    return sock;
+}
+
+/* Next を表示して次へ進む。届いていなかった (再送も来ていない) ときは0を返す */
+static int flush_next(void (*deliver)(const char *msg)) {
+    pending_entry *p = &Pending[Next % MCAST_WINDOW];
+    int arrived = p->seq == Next;
+    if (arrived && !p->lost && p->slot != My_slot) {
+        deliver(p->msg);
+    }
+    Next++;
+    return arrived;
+}
+
+/* seq までに抜けがあれば、まだ要求していない範囲をNACKする */
+static void request_missing(uint64_t seq, void (*nack)(uint64_t from, uint64_t to)) {
+    uint64_t from = Next > Nacked + 1 ? Next : Nacked + 1;
+    if (from <= seq) {
+        nack(from, seq);
+        Nacked = seq;
+    }
+}
+
+void mcast_client_receive(const char *line,
+                          void (*deliver)(const char *msg),
+                          void (*nack)(uint64_t from, uint64_t to)) {
+    unsigned long long seq;
+    int slot = -1, offset = 0, lost = 0;
+
+    if (sscanf(line, "SEQ %llu %d %n", &seq, &slot, &offset) == 2 ||
+        sscanf(line, "RTX %llu %d %n", &seq, &slot, &offset) == 2) {
+        lost = 0;
+    } else if (sscanf(line, "LOST %llu", &seq) == 1) {
+        lost = 1;
+    } else if (sscanf(line, "LAST %llu", &seq) == 1) {
+        if (Next != 0 && seq >= Next) {
+            request_missing(seq, nack);
+        }
+        return;
+    } else if (sscanf(line, "MCSTART %llu", &seq) == 1) {
+        // MCSTARTより前に届いたデータグラムも保持しておき、ここから表示する
+        Next = seq;
+        Nacked = seq - 1;
+        while (Pending[Next % MCAST_WINDOW].seq == Next) {
+            flush_next(deliver);
+        }
+        return;
+    } else {
+        return;
+    }
+    if (Next == 0) {
+        Pending[seq % MCAST_WINDOW].seq = seq;
+        Pending[seq % MCAST_WINDOW].slot = slot;
+        Pending[seq % MCAST_WINDOW].lost = lost;
+        snprintf(Pending[seq % MCAST_WINDOW].msg, BUFSIZE, "%s", lost ? "" : line + offset);
+        return;
+    }
+    if (seq < Next) {
+        return; // 受信済み
+    }
+
+    // 並べ替えの窓を超えて遅れた場合は、持っている分だけ表示して追いつく。
+    // 飛ばしたメッセージは後から再送が届いても表示できないので、範囲を知らせる
+    uint64_t skipped = 0, first = Next;
+    while (seq >= Next + MCAST_WINDOW) {
+        if (!flush_next(deliver)) skipped++;
+    }
+    if (skipped > 0) {
+        fprintf(stderr, "Multicast: gave up on %llu missing messages between seq %llu and %llu\n",
+                (unsigned long long)skipped, (unsigned long long)first, (unsigned long long)(Next - 1));
+    }
+
+    pending_entry *p = &Pending[seq % MCAST_WINDOW];
+    p->seq = seq;
+    p->slot = slot;
+    p->lost = lost;
+    snprintf(p->msg, sizeof(p->msg), "%s", lost ? "" : line + offset);
+
+    while (Pending[Next % MCAST_WINDOW].seq == Next) {
+        flush_next(deliver);
+    }
+
+    if (seq > Next) {
+        request_missing(seq - 1, nack);
+    }
+    if (seq > Nacked) {
+        Nacked = seq; // 届いたものは要求しない
+    }
+}
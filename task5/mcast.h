@@ -0,0 +1,56 @@
+#ifndef MCAST_H_
+#define MCAST_H_
+/*
+  mcast.h
+  LAN向けのマルチキャスト配信モード。
+  サーバはJOINへの応答として "MCST <group> <port> <slot>" をTCPで知らせ、
+  グループに参加したクライアントは "MCOK" を返す。サーバは "MCSTART <seq>" で
+  マルチキャストに切り替わるseqを知らせ、以降ルームのメッセージは
+  "SEQ <seq> <slot> <text>" としてグループへ1回だけ送られる。
+  クライアントは抜けたseqを "NACK <from> <to>" でTCP経由で要求し、
+  サーバは "RTX <seq> <slot> <text>" (履歴にない場合は "LOST <seq>") で再送する。
+  後続のないメッセージの抜けにも気づけるよう、サーバは "LAST <seq>" を定期的にグループへ送る。
+*/
+#include "mynet.h"
+#include <stdint.h>
+
+#define MCAST_DEFAULT_GROUP "239.255.50.1"
+#define MCAST_DEFAULT_PORT 50002
+#define MCAST_HISTORY 1024 /* 再送用に保持するメッセージ数 */
+#define MCAST_WINDOW 64 /* クライアントが並べ替えのために保持するメッセージ数 */
+#define MCAST_BEACON_SEC 1 /* LASTを送る間隔 */
+
+/* サーバ側: 送信用ソケットを用意する。iface はマルチキャストに使うインタフェースのアドレス */
+int mcast_server_init(const char *group, in_port_t port, const char *iface);
+
+/* サーバ側: slot のクライアントへ送る MCST 行を作る */
+int mcast_announce(char *buf, size_t size, int slot);
+
+/* サーバ側: MCOK を受けたクライアントへ送る MCSTART 行を作る */
+int mcast_start(char *buf, size_t size);
+
+/* サーバ側: メッセージにseqを振って履歴に残し、グループへ送る。from_slot は送信者 (サーバ自身は-1) */
+uint64_t mcast_send(const char *msg, int from_slot);
+
+/* サーバ側: 一定間隔で最後に振ったseqを LAST としてグループへ送る。次に送るまでの秒数を返す */
+int mcast_tick(void);
+
+/* サーバ側: 次に振るseq (無停止入れ替えで新しいプロセスに渡す) */
+uint64_t mcast_next_seq(void);
+
+/* サーバ側: 古いプロセスのseqの続きから振る (履歴は引き継がないので、それより前のNACKにはLOSTを返す) */
+void mcast_resume(uint64_t next_seq);
+
+/* サーバ側: NACKで要求された範囲の RTX/LOST 行を1行ずつ out に渡す */
+void mcast_retransmit(uint64_t from, uint64_t to, void (*out)(const char *line, void *arg), void *arg);
+
+/* クライアント側: MCST 行を受けてグループに参加し、受信用ソケットを返す */
+int mcast_client_join(const char *announce, const char *iface);
+
+/* クライアント側: 受信したデータグラム (SEQ/LAST) または MCSTART/RTX/LOST 行を処理する。
+   順番どおりになったメッセージは deliver に渡し、抜けがあれば nack に要求範囲を渡す */
+void mcast_client_receive(const char *line,
+                          void (*deliver)(const char *msg),
+                          void (*nack)(uint64_t from, uint64_t to));
+
+#endif /* MCAST_H_ */
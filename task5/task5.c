@@ -3,24 +3,84 @@
   サーバーとクライアントの端末が見やすくように、デバッグ用のprintfステートメントは一応コメントアウトしています。
 */
 
-#include "mynet.h"
+#include "task5.h"
+#include "chatlog.h"
+#include "federation.h"
+#include "mcast.h"
 #include <arpa/inet.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 
-#define BUFSIZE 512
 #define MAX_CLIENTS 30
-#define DEFAULT_PORT 50001
+#define DRR_QUANTUM 128 // 1巡で1クライアントに処理させる行のバイト数 (受信バッファより小さくする)
+#define DEFAULT_BURST 10
 #define TIMEOUT_SEC 5
 #define MAX_RETRIES 3
 
+// 無停止入れ替えで送るレコードの種類
+#define HANDOFF_LISTEN 0 // TCPのリスニングソケット
+#define HANDOFF_UDP 1 // HELOを受けるUDPソケット (連合モードでは新しいプロセスが作り直す)
+#define HANDOFF_CLIENT 2 // 接続中のクライアント
+#define HANDOFF_END 3 // 引き継ぎの終わり (新しいプロセスは長さ0のレコードで応える)
+#define HANDOFF_LINKS 4 // 連合のリンク (federation_hand_off()のレコードが続く)
+
 typedef struct {
     int sock;
     char username[16];
+    int mcast; // マルチキャストで受信しているかどうか
+    outq out; // まとめて送るために溜めているメッセージ
+    char inbuf[BUFSIZE]; // 改行で終わっていない受信データ
+    int inlen;
+    int deficit; // DRRで処理できる残りバイト数 (行の単位で使う)
+    token_bucket bucket; // POSTの流量制限
 } ClientInfo;
 
+// 無停止入れ替えで新しいプロセスに渡す状態
+typedef struct {
+    int kind;
+    int slot; // clientsの添字。マルチキャストの送信元はこの番号で見分けるので変えない
+    char username[16];
+    int mcast;
+    int inlen;
+    char inbuf[BUFSIZE]; // 改行で終わっていない受信データもそのまま渡す
+    size_t outlen; // 続けて送る送信キューの未送信バイト数
+    uint64_t mcast_seq; // ENDで渡す、次に振るマルチキャストのseq
+} HandoffRecord;
+
+static int Logging = 0; // チャットログを記録するかどうか
+static char *Log_dir = NULL; // 入れ替えに失敗したときにログを開き直すディレクトリ
+static int Log_sync_ms;
+static int Federated = 0; // 他のサーバとリンクするかどうか
+static in_port_t Tcp_port = DEFAULT_PORT; // HEREで知らせるTCPポート
+static int Multicast = 0; // ルームのメッセージをマルチキャストで配信するかどうか
+static char *Mcast_iface = NULL; // マルチキャストに使うインタフェースのアドレス
+static long Flush_window_us = 0; // 送信をまとめる時間 (0ならループ1回分)
+static double Rate_limit = 0; // クライアントごとの1秒あたりのPOST数 (0なら無制限)
+static double Rate_burst = DEFAULT_BURST;
+static char *Upgrade_path = NULL; // 無停止入れ替えに使うUnixソケットのパス
+static int Handoff_sock = -1; // 新しいプロセスからの引き継ぎ要求を待つソケット
+static volatile sig_atomic_t Terminate = 0;
+static volatile sig_atomic_t Dump_stats = 0;
+
+extern char *optarg;
+extern int optind, opterr, optopt;
+
+// SIGINT/SIGTERMでサーバーループを抜け、ログを書き切ってから終了する
+static void terminate_handler(int sig) {
+    (void)sig;
+    Terminate = 1;
+}
+
+// SIGUSR1でクライアントごとの流量制限の統計を表示する
+static void stats_handler(int sig) {
+    (void)sig;
+    Dump_stats = 1;
+}
+
 // ソケットをノンブロッキングモードに設定する関数
 void set_nonblocking(int sock) {
     int flags = fcntl(sock, F_GETFL, 0);
@@ -38,11 +98,67 @@ void set_nonblocking(int sock) {
 void init_client_array(ClientInfo clients[]) {
     for (int i = 0; i < MAX_CLIENTS; i++) {
         clients[i].sock = 0;
+        clients[i].mcast = 0;
+        clients[i].inlen = 0;
+        memset(&clients[i].out, 0, sizeof(outq));
     }
 }
 
+// クライアントを切断し、送信キューに残っているメッセージを捨てる
+static void close_client(ClientInfo *client) {
+    close(client->sock);
+    client->sock = 0;
+    client->inlen = 0;
+    outq_clear(&client->out);
+}
+
+// メッセージを送信キューに入れる。実際の送信はループの最後か、窓が閉じたときにまとめて行う
+static void queue_message(ClientInfo *client, outmsg *m) {
+    if (outq_push(&client->out, m, outq_now()) == -1) {
+        fprintf(stderr, "%s is too slow to receive, disconnecting.\n", client->username);
+        close_client(client);
+    }
+}
+
+static void queue_line(ClientInfo *client, const char *line) {
+    outmsg *m = outmsg_new(line);
+    queue_message(client, m);
+    outmsg_release(m);
+}
+
+// 窓が閉じたクライアント(force なら全員)の送信キューを送り出す。次に窓が閉じるまでの時間を返す
+static long flush_clients(ClientInfo clients[], int force) {
+    uint64_t now = outq_now();
+    long next = -1;
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        outq *q = &clients[i].out;
+        if (clients[i].sock <= 0 || q->count == 0) continue;
+
+        uint64_t due = q->since + Flush_window_us;
+        if (force || Flush_window_us == 0 || now >= due || q->bytes >= OUTQ_FLUSH_BYTES) {
+            if (outq_flush(clients[i].sock, q) == -1) {
+                perror("writev");
+                close_client(&clients[i]);
+            }
+        } else if (next == -1 || (long)(due - now) < next) {
+            next = due - now;
+        }
+    }
+    return next;
+}
+
+// 1つのメッセージを改行で区切って送る (複数のメッセージが1回のrecvで届いても分けられるように)
+static int send_message(int sock, const char *msg) {
+    char line[BUFSIZE + 128];
+    int len = snprintf(line, sizeof(line) - 1, "%s", msg);
+    if (len > (int)sizeof(line) - 2) len = sizeof(line) - 2;
+    line[len++] = '\n';
+    return send(sock, line, len, 0);
+}
+
 // HELOパケットをブロードキャストし、HERE応答を待ちます
-int broadcast_helo(int udp_sock, struct sockaddr_in *broadcast_adrs, char *server_ip, size_t ip_len) {
+int broadcast_helo(int udp_sock, struct sockaddr_in *broadcast_adrs, char *server_ip, size_t ip_len, in_port_t *server_port) {
     for (int retries = 0; retries < MAX_RETRIES; retries++) {
         char buffer[BUFSIZE];
         snprintf(buffer, sizeof(buffer), "HELO");
@@ -62,6 +178,9 @@ int broadcast_helo(int udp_sock, struct sockaddr_in *broadcast_adrs, char *serve
             buffer[strsize] = '\0';
             if (strncmp(buffer, "HERE", 4) == 0) {
                 strncpy(server_ip, inet_ntoa(from_adrs.sin_addr), ip_len);
+                // 連合モードのサーバは "HERE <port>" で自分のTCPポートを知らせる
+                unsigned port;
+                *server_port = (sscanf(buffer, "HERE %u", &port) == 1) ? (in_port_t)port : DEFAULT_PORT;
                 // printf("Received HERE from %s\n", inet_ntoa(from_adrs.sin_addr));
                 close(udp_sock);
                 return 1; // サーバーが見つかりました
@@ -71,10 +190,41 @@ int broadcast_helo(int udp_sock, struct sockaddr_in *broadcast_adrs, char *serve
     return 0; // サーバーが見つかりません
 }
 
+static int Client_sock; // クライアントとして接続しているソケット
+
+static void print_message(const char *msg) {
+    printf("%s\n", msg);
+}
+
+// 抜けたseqの再送をサーバに要求する
+static void send_nack(uint64_t from, uint64_t to) {
+    char line[64];
+    snprintf(line, sizeof(line), "NACK %llu %llu", (unsigned long long)from, (unsigned long long)to);
+    send_message(Client_sock, line);
+}
+
+// サーバから受信した1行を処理する
+static void handle_server_line(char *line, int *mcast_sock) {
+    if (strncmp(line, "MCST ", 5) == 0) {
+        // マルチキャストに参加できたときだけMCOKを返す (失敗すればTCPで受け取り続ける)
+        if ((*mcast_sock = mcast_client_join(line, Mcast_iface)) != -1) {
+            send_message(Client_sock, "MCOK");
+        }
+    } else if (strncmp(line, "MCSTART ", 8) == 0 || strncmp(line, "RTX ", 4) == 0 || strncmp(line, "LOST ", 5) == 0) {
+        mcast_client_receive(line, print_message, send_nack);
+    } else {
+        printf("%s\n", line);
+    }
+}
+
 // クライアントの操作を処理します
 void handle_client(int tcp_sock, char *username) {
     char buf[BUFSIZE];
+    char inbuf[BUFSIZE * 2]; // 改行で区切られていない受信データ
+    int inlen = 0;
+    int mcast_sock = -1;
     memset(buf, 0, BUFSIZE);
+    Client_sock = tcp_sock;
     printf("\nWelcome to the chatroom, %s!\n", username);
     printf("You can start chatting now or wait for others to join!\nTo exit, you can type 'QUIT'.\n\n");
 
@@ -85,13 +235,40 @@ void handle_client(int tcp_sock, char *username) {
         FD_SET(fileno(stdin), &readfds);
 
         int maxfd = (tcp_sock > fileno(stdin)) ? tcp_sock : fileno(stdin);
+        if (mcast_sock != -1) {
+            FD_SET(mcast_sock, &readfds);
+            if (mcast_sock > maxfd) maxfd = mcast_sock;
+        }
         select(maxfd + 1, &readfds, NULL, NULL, NULL);
 
         if (FD_ISSET(tcp_sock, &readfds)) {
-            int strsize = recv(tcp_sock, buf, BUFSIZE, 0);
+            int strsize = recv(tcp_sock, inbuf + inlen, sizeof(inbuf) - inlen - 1, 0);
             if (strsize <= 0) break;
-            buf[strsize] = '\0';
-            printf("%s\n", buf);
+            inlen += strsize;
+            inbuf[inlen] = '\0';
+
+            char *line = inbuf, *nl;
+            while ((nl = strchr(line, '\n')) != NULL) {
+                *nl = '\0';
+                handle_server_line(line, &mcast_sock);
+                line = nl + 1;
+            }
+            inlen -= line - inbuf;
+            memmove(inbuf, line, inlen);
+            if (inlen == (int)sizeof(inbuf) - 1) {
+                // 改行のない長い行はそのまま表示する
+                inbuf[inlen] = '\0';
+                printf("%s\n", inbuf);
+                inlen = 0;
+            }
+        }
+
+        if (mcast_sock != -1 && FD_ISSET(mcast_sock, &readfds)) {
+            int strsize = recv(mcast_sock, buf, BUFSIZE - 1, 0);
+            if (strsize > 0) {
+                buf[strsize] = '\0';
+                mcast_client_receive(buf, print_message, send_nack);
+            }
         }
 
         if (FD_ISSET(fileno(stdin), &readfds)) {
@@ -99,18 +276,45 @@ void handle_client(int tcp_sock, char *username) {
             if (fgets(buf, BUFSIZE, stdin) != NULL) {
                 buf[strlen(buf) - 1] = '\0';
                 if (strcmp(buf, "QUIT") == 0) {
-                    send(tcp_sock, "QUIT", 4, 0);
+                    send_message(tcp_sock, "QUIT");
                     break;
                 }
                 char sendbuf[BUFSIZE];
                 snprintf(sendbuf, BUFSIZE, "POST %s", buf);
-                send(tcp_sock, sendbuf, strlen(sendbuf), 0);
+                send_message(tcp_sock, sendbuf);
             }
         }
     }
+    if (mcast_sock != -1) close(mcast_sock);
     close(tcp_sock);
 }
 
+// ルームのメッセージを except 以外のクライアントに配る。
+// マルチキャストで受信しているクライアントには、グループへの1回の送信で届く
+static void broadcast_room(ClientInfo clients[], int except, const char *msg) {
+    outmsg *m = outmsg_new(msg); // 全員の送信キューで同じバッファを共有する
+
+    if (Multicast) mcast_send(msg, except);
+    for (int j = 0; j < MAX_CLIENTS; j++) {
+        if (clients[j].sock > 0 && j != except && !clients[j].mcast) {
+            queue_message(&clients[j], m);
+        }
+    }
+    outmsg_release(m);
+}
+
+// 他のサーバから中継されたメッセージをローカルのクライアント全員に送る
+static void deliver_local(const char *msg, void *arg) {
+    ClientInfo *clients = arg;
+    printf("%s\n", msg);
+    if (Logging) chatlog_append(msg, strlen(msg));
+    broadcast_room(clients, -1, msg);
+}
+
+static void send_to_client(const char *line, void *arg) {
+    queue_line(arg, line);
+}
+
 // クライアントからのメッセージを処理する関数
 void process_client_message(int sockfd, ClientInfo clients[], int idx, char *buf) {
     char message[BUFSIZE + 50];
@@ -120,51 +324,296 @@ void process_client_message(int sockfd, ClientInfo clients[], int idx, char *buf
         strncpy(clients[idx].username, buf + 5, 15);
         clients[idx].username[15] = '\0';
         printf("%s joined the chat.\n", clients[idx].username);
+        if (Multicast) {
+            mcast_announce(message, sizeof(message), idx);
+            queue_line(&clients[idx], message);
+        }
     } else if (strncmp(buf, "POST ", 5) == 0) {
+        if (!tb_take(&clients[idx].bucket)) {
+            return; // 流量制限を超えたPOSTは表示も配信もせずに捨てる
+        }
         snprintf(message, sizeof(message), "[%s] %s", clients[idx].username, buf + 5);
         printf("%s\n", message);
-        for (int j = 0; j < MAX_CLIENTS; j++) {
-            if (clients[j].sock > 0 && j != idx) {
-                if (send(clients[j].sock, message, strlen(message), 0) < 0) {
-                    perror("send error");
-                }
-            }
+        if (Logging) chatlog_append(message, strlen(message));
+        broadcast_room(clients, idx, message);
+        if (Federated) federation_publish(message);
+    } else if (Multicast && strcmp(buf, "MCOK") == 0) {
+        // このseqより後のメッセージはグループへの送信だけで届く
+        mcast_start(message, sizeof(message));
+        queue_line(&clients[idx], message);
+        clients[idx].mcast = 1;
+    } else if (Multicast && strncmp(buf, "NACK ", 5) == 0) {
+        unsigned long long from, to;
+        if (sscanf(buf, "NACK %llu %llu", &from, &to) == 2) {
+            mcast_retransmit(from, to, send_to_client, &clients[idx]);
         }
+    } else if (Federated && strncmp(buf, "LINK ", 5) == 0) {
+        // 他のサーバからのリンク: クライアントの配列から外してリンクとして扱う
+        clients[idx].sock = 0;
+        outq_clear(&clients[idx].out);
+        federation_adopt(sockfd, buf, deliver_local, clients);
     } else if (strcmp(buf, "QUIT") == 0) {
         printf("%s has left the chat.\n", clients[idx].username);
-        close(sockfd);
-        clients[idx].sock = 0;
+        close_client(&clients[idx]);
+    }
+}
+
+// 受信バッファにたまった行を、DRRの持ち分 (deficit) の範囲で1行ずつ処理する。
+// 持ち分に収まらない行は次の巡回まで残すので、メッセージの途中で区切られることはない。
+// 処理できる行が残っていれば1を返す
+static int process_client_data(int sockfd, ClientInfo clients[], int idx) {
+    ClientInfo *client = &clients[idx];
+    char *line = client->inbuf, *end = client->inbuf + client->inlen, *nl;
+
+    client->deficit += DRR_QUANTUM;
+    while (client->sock == sockfd && line < end) {
+        if (Federated && strncmp(line, "LINK ", 5) == 0) {
+            // リンクに切り替わった後のデータはそのままリンクへ渡す
+            *end = '\0';
+            client->inlen = 0;
+            process_client_message(sockfd, clients, idx, line);
+            return 0;
+        }
+        if ((nl = memchr(line, '\n', end - line)) == NULL || nl - line + 1 > client->deficit) {
+            break;
+        }
+        client->deficit -= nl - line + 1;
+        *nl = '\0';
+        line[strcspn(line, "\r")] = '\0';
+        if (*line != '\0') {
+            process_client_message(sockfd, clients, idx, line);
+        }
+        line = nl + 1;
+    }
+    if (client->sock != sockfd) return 0;
+
+    // 残りは次の巡回まで持ち越す。処理を待つ行がなければ持ち分も持ち越さない
+    client->inlen = end - line;
+    memmove(client->inbuf, line, client->inlen);
+    if (memchr(client->inbuf, '\n', client->inlen) != NULL) {
+        return 1;
+    }
+    client->deficit = 0;
+    if (client->inlen >= BUFSIZE - 2) client->inlen = 0; // 長すぎる行は捨てる
+    return 0;
+}
+
+static void print_stats(ClientInfo clients[]) {
+    printf("--- rate limit: %.1f msg/s, burst %.0f ---\n", Rate_limit, Rate_burst);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].sock > 0) {
+            printf("%-16s passed %lu, dropped %lu\n", clients[i].username,
+                   clients[i].bucket.passed, clients[i].bucket.dropped);
+        }
+    }
+    fflush(stdout);
+}
+
+// 新しいプロセスにソケットとクライアントを渡す。送信キューの未送信分もソケットに続けて渡すので、
+// 読まないクライアントがいても入れ替えは止まらない。新しいプロセスが受け取り終えたと応えるまでは
+// 何も手放さず、途中で失敗すればそのまま動き続ける
+static void hand_off(int udp_sock, int tcp_sock, ClientInfo clients[]) {
+    HandoffRecord rec;
+    int conn, fd, n = 0;
+
+    if ((conn = handoff_accept(Handoff_sock)) == -1) {
+        return;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = HANDOFF_LISTEN;
+    if (handoff_send(conn, tcp_sock, &rec, sizeof(rec)) == -1) {
+        goto failed;
+    }
+    if (!Federated) {
+        rec.kind = HANDOFF_UDP;
+        if (handoff_send(conn, udp_sock, &rec, sizeof(rec)) == -1) {
+            goto failed;
+        }
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].sock <= 0) continue;
+        rec.kind = HANDOFF_CLIENT;
+        rec.slot = i;
+        memcpy(rec.username, clients[i].username, sizeof(rec.username));
+        rec.mcast = clients[i].mcast;
+        rec.inlen = clients[i].inlen;
+        memcpy(rec.inbuf, clients[i].inbuf, clients[i].inlen);
+        rec.outlen = clients[i].out.bytes;
+        if (handoff_send(conn, clients[i].sock, &rec, sizeof(rec)) == -1 ||
+            handoff_send_outq(conn, &clients[i].out) == -1) {
+            goto failed;
+        }
+        n++;
+    }
+    if (Federated) {
+        rec.kind = HANDOFF_LINKS;
+        if (handoff_send(conn, -1, &rec, sizeof(rec)) == -1 || federation_hand_off(conn) == -1) {
+            goto failed;
+        }
     }
+    // 新しいプロセスが同じディレクトリに続きのセグメントを作る前に閉じる
+    if (Logging) chatlog_close();
+    rec.kind = HANDOFF_END;
+    rec.mcast_seq = Multicast ? mcast_next_seq() : 0;
+    if (handoff_send(conn, -1, &rec, sizeof(rec)) == -1 || handoff_recv(conn, &fd, NULL, 0) != 0) {
+        if (Logging && chatlog_open(Log_dir, Log_sync_ms) == -1) {
+            Logging = 0;
+        }
+        goto failed;
+    }
+    close(conn);
+
+    // 送り残しは新しいプロセスが送るので、こちらでは捨てる
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].sock > 0) outq_clear(&clients[i].out);
+    }
+    Logging = 0;
+    printf("Handed off %d clients to the new server.\n", n);
+    Terminate = 1;
+    return;
+
+failed:
+    // 新しいプロセスはENDを受け取れなければ終了し、渡したソケットはこちらに残っている
+    fprintf(stderr, "Hot upgrade aborted, still serving.\n");
+    close(conn);
+}
+
+// 古いプロセスからソケットとクライアントを受け取る。次に振るマルチキャストのseqを返す
+static uint64_t take_over(int conn, ClientInfo clients[], int *tcp_sock, int *udp_sock) {
+    HandoffRecord rec;
+    int fd, n = 0;
+
+    while (handoff_recv(conn, &fd, &rec, sizeof(rec)) == sizeof(rec)) {
+        if (rec.kind == HANDOFF_END) {
+            // 受け取り終えたことを知らせると、古いプロセスは終了する
+            if (handoff_send(conn, -1, NULL, 0) == -1) break;
+            printf("Took over %d clients from the old server.\n", n);
+            return rec.mcast_seq;
+        } else if (rec.kind == HANDOFF_LISTEN) {
+            *tcp_sock = fd;
+        } else if (rec.kind == HANDOFF_UDP) {
+            *udp_sock = fd;
+        } else if (rec.kind == HANDOFF_LINKS) {
+            if (!Federated) {
+                fprintf(stderr, "The old server is federated; start the new one with -F\n");
+                break;
+            }
+            if (federation_take_over(conn) == -1) break;
+        } else if (rec.kind == HANDOFF_CLIENT) {
+            // MCSTで知らせた番号のまま同じ場所に戻す
+            int i = rec.slot;
+            if (i < 0 || i >= MAX_CLIENTS || clients[i].sock != 0) {
+                close(fd);
+                if (handoff_recv_outq(conn, NULL, rec.outlen) == -1) break;
+                continue;
+            }
+            set_nonblocking(fd);
+            clients[i].sock = fd;
+            memcpy(clients[i].username, rec.username, sizeof(rec.username));
+            clients[i].mcast = rec.mcast;
+            clients[i].inlen = rec.inlen >= 0 && rec.inlen < BUFSIZE ? rec.inlen : 0;
+            memcpy(clients[i].inbuf, rec.inbuf, clients[i].inlen);
+            clients[i].deficit = 0;
+            tb_init(&clients[i].bucket, Rate_limit, Rate_burst);
+            if (handoff_recv_outq(conn, &clients[i].out, rec.outlen) == -1) break;
+            n++;
+        }
+    }
+    fprintf(stderr, "Hot upgrade failed: handoff ended early\n");
+    exit(EXIT_FAILURE);
 }
 
 void handle_server(int udp_sock, int tcp_sock, ClientInfo clients[], char *username) {
     struct sockaddr_in from_adrs, client_adrs;
     socklen_t from_len;
-    fd_set readfds;
+    fd_set readfds, writefds;
     char buf[BUFSIZE];
     int client_sock, i, strsize;
+    long window = -1;
+    int rr_start = 0; // 受信処理を始めるクライアント (ループごとに1つずつずらす)
+    int backlog = 0; // 持ち分を使い切って処理を待っている行がある
 
     printf("Now, I am a server.\n");
 
-    while (1) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = terminate_handler;
+    sigaction(SIGINT, &sa, NULL); // SA_RESTARTなしでselect()を中断させる
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = stats_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+    // 切断したクライアントや、入れ替えの途中で終了した新しいプロセスへの送信で終了しないようにする
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!Terminate) {
+        if (Dump_stats) {
+            Dump_stats = 0;
+            print_stats(clients);
+        }
+
         FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
         FD_SET(udp_sock, &readfds);
         FD_SET(tcp_sock, &readfds);
         FD_SET(fileno(stdin), &readfds); // サーバー自身の入力を監視する
         int maxfd = udp_sock > tcp_sock ? udp_sock : tcp_sock;
         maxfd = maxfd > fileno(stdin) ? maxfd : fileno(stdin);
+        if (Handoff_sock != -1) {
+            FD_SET(Handoff_sock, &readfds);
+            maxfd = maxfd > Handoff_sock ? maxfd : Handoff_sock;
+        }
+        struct timeval tick, *timeout = NULL;
+        if (Federated) {
+            maxfd = federation_fdset(&readfds, &writefds, maxfd);
+            tick.tv_sec = federation_tick(udp_sock);
+            tick.tv_usec = 0;
+            timeout = &tick;
+        }
+        if (Multicast) {
+            int sec = mcast_tick();
+            if (timeout == NULL || sec < tick.tv_sec) {
+                tick.tv_sec = sec;
+                tick.tv_usec = 0;
+                timeout = &tick;
+            }
+        }
+        if (window >= 0 && (timeout == NULL || window < tick.tv_sec * 1000000L)) {
+            // 送信待ちのメッセージがあれば、窓が閉じるときに起きる
+            tick.tv_sec = window / 1000000;
+            tick.tv_usec = window % 1000000;
+            timeout = &tick;
+        }
+        if (backlog) {
+            // 処理を待つ行があれば、次の巡回をすぐに始める
+            tick.tv_sec = tick.tv_usec = 0;
+            timeout = &tick;
+        }
 
         for (i = 0; i < MAX_CLIENTS; i++) {
             int sockfd = clients[i].sock;
             if (sockfd > 0) {
                 FD_SET(sockfd, &readfds);
+                if (clients[i].out.blocked) {
+                    FD_SET(sockfd, &writefds);
+                }
             }
             if (sockfd > maxfd) {
                 maxfd = sockfd;
             }
         }
 
-        select(maxfd + 1, &readfds, NULL, NULL, NULL);
+        if (select(maxfd + 1, &readfds, &writefds, NULL, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("select");
+            break;
+        }
+
+        // 新しいプロセスが起動したら、未読のデータはソケットに残したまま引き渡して終了する
+        if (Handoff_sock != -1 && FD_ISSET(Handoff_sock, &readfds)) {
+            hand_off(udp_sock, tcp_sock, clients);
+            if (Terminate) break;
+        }
 
         if (FD_ISSET(udp_sock, &readfds)) {
             from_len = sizeof(from_adrs);
@@ -172,8 +621,12 @@ void handle_server(int udp_sock, int tcp_sock, ClientInfo clients[], char *usern
             if (strsize > 0) {
                 buf[strsize] = '\0';
                 if (strncmp(buf, "HELO", 4) == 0) {
-                    sendto(udp_sock, "HERE", 5, 0, (struct sockaddr *)&from_adrs, from_len);
+                    char here[16];
+                    int len = snprintf(here, sizeof(here), "HERE %u", Tcp_port);
+                    sendto(udp_sock, here, len + 1, 0, (struct sockaddr *)&from_adrs, from_len);
                     // printf("Sent HERE in response to HELO from %s:%d\n", inet_ntoa(from_adrs.sin_addr), ntohs(from_adrs.sin_port));
+                } else if (Federated) {
+                    federation_handle_udp(udp_sock, buf, &from_adrs);
                 }
             }
         }
@@ -185,6 +638,10 @@ void handle_server(int udp_sock, int tcp_sock, ClientInfo clients[], char *usern
                 for (i = 0; i < MAX_CLIENTS; i++) {
                     if (clients[i].sock == 0) {
                         clients[i].sock = client_sock;
+                        clients[i].mcast = 0;
+                        clients[i].inlen = 0;
+                        clients[i].deficit = 0;
+                        tb_init(&clients[i].bucket, Rate_limit, Rate_burst);
                         // printf("New connection, socket fd is %d, ip is : %s, port : %d, client index: %d\n",
                         //        client_sock, inet_ntoa(client_adrs.sin_addr), ntohs(client_adrs.sin_port), i);
                         break;
@@ -199,56 +656,150 @@ void handle_server(int udp_sock, int tcp_sock, ClientInfo clients[], char *usern
             }
         }
 
+        if (Federated) {
+            federation_poll(&readfds, &writefds, deliver_local, clients);
+        }
+
         if (FD_ISSET(fileno(stdin), &readfds)) {
             memset(buf, 0, BUFSIZE);
             if (fgets(buf, BUFSIZE, stdin) != NULL) {
                 buf[strlen(buf) - 1] = '\0';
                 char sendbuf[BUFSIZE];
                 snprintf(sendbuf, BUFSIZE, "MESG [%s] %s", username, buf);
+                if (Logging) chatlog_append(sendbuf + 5, strlen(sendbuf + 5));
+                if (Federated) federation_publish(sendbuf);
                 // printf("%s\n", sendbuf); // サーバーの端末にメッセージを表示する
-                for (i = 0; i < MAX_CLIENTS; i++) {
-                    if (clients[i].sock > 0) {
-                        if (send(clients[i].sock, sendbuf, strlen(sendbuf), 0) < 0) {
-                            perror("send error");
-                            close(clients[i].sock);
-                            clients[i].sock = 0;
-                        }
-                    }
-                }
+                broadcast_room(clients, -1, sendbuf);
             }
         }
 
-        for (i = 0; i < MAX_CLIENTS; i++) {
+        // 配列の先頭のクライアントばかり優先しないよう、開始位置を回しながら
+        // 1巡ごとにDRR_QUANTUMバイト分ずつ行を処理する (Deficit Round Robin)
+        backlog = 0;
+        for (int k = 0; k < MAX_CLIENTS; k++) {
+            i = (rr_start + k) % MAX_CLIENTS;
             int sockfd = clients[i].sock;
-            if (sockfd > 0 && FD_ISSET(sockfd, &readfds)) {
-                if ((strsize = recv(sockfd, buf, BUFSIZE, 0)) <= 0) {
-                    if (strsize == 0) {
-                        // printf("Host disconnected normally, client index: %d\n", i);
-                    } else {
+            if (sockfd <= 0) continue;
+            // 改行を付ける余地を残して読む
+            int want = BUFSIZE - 2 - clients[i].inlen;
+            if (FD_ISSET(sockfd, &readfds) && want > 0) {
+                int fresh = clients[i].inlen == 0;
+                if ((strsize = recv(sockfd, clients[i].inbuf + clients[i].inlen, want, 0)) <= 0) {
+                    if (strsize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+                    if (strsize < 0) {
                         perror("recv error");
                     }
-                    close(sockfd);
-                    clients[i].sock = 0;
-                    // printf("Socket %d closed\n", sockfd);
-                } else {
-                    buf[strsize] = '\0';
-                    process_client_message(sockfd, clients, i, buf);
+                    close_client(&clients[i]);
+                    continue;
+                }
+                clients[i].inlen += strsize;
+                // 改行を送らない従来のクライアントは、1回のrecvを1つのメッセージとして扱う
+                if (fresh && memchr(clients[i].inbuf, '\n', clients[i].inlen) == NULL) {
+                    clients[i].inbuf[clients[i].inlen++] = '\n';
                 }
+            } else if (clients[i].inlen == 0) {
+                continue;
+            }
+            backlog |= process_client_data(sockfd, clients, i);
+        }
+        rr_start = (rr_start + 1) % MAX_CLIENTS;
+
+        // ソケットが空いたクライアントの残りを送る
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            int sockfd = clients[i].sock;
+            if (sockfd > 0 && FD_ISSET(sockfd, &writefds) && outq_flush(sockfd, &clients[i].out) == -1) {
+                perror("writev");
+                close_client(&clients[i]);
             }
         }
+
+        // このループで溜まったメッセージを、接続ごとに1回のwritevで送る
+        window = flush_clients(clients, 0);
     }
+    flush_clients(clients, 1);
+}
+
+// ログのレコードを1行ずつ表示する
+static void print_record(const chatlog_record *rec, const char *msg, void *arg) {
+    (void)arg;
+    time_t sec = rec->usec / 1000000;
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&sec));
+    printf("%llu %s %.*s\n", (unsigned long long)rec->seq, stamp, (int)rec->len, msg);
+}
+
+static void print_usage(char *program_name) {
+    fprintf(stderr, "Usage: %s [-F] [-M group[:port]] [-I iface_addr] [-w window_us] [-r rate] [-b burst] [-l log_dir] [-i sync_ms]"
+                    " [-U upgrade_path]"
+                    " username [port_number]\n", program_name);
+    fprintf(stderr, "       %s -R log_dir\n", program_name);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2 || argc > 3) {
-        fprintf(stderr, "Usage: %s username [port_number]\n", argv[0]);
+    char *log_dir = NULL;
+    char mcast_group[32] = MCAST_DEFAULT_GROUP;
+    in_port_t mcast_port = MCAST_DEFAULT_PORT;
+    int sync_ms = CHATLOG_DEFAULT_SYNC_MS;
+    int c;
+
+    opterr = 0;
+    while ((c = getopt(argc, argv, "FM:I:w:r:b:l:i:R:U:h")) != -1) {
+        switch (c) {
+        case 'F': // 他のサーバと連合するサーバとして起動する
+            Federated = 1;
+            break;
+        case 'M': // ルームのメッセージをマルチキャストで配信する
+            Multicast = 1;
+            snprintf(mcast_group, sizeof(mcast_group), "%s", optarg);
+            char *colon = strchr(mcast_group, ':');
+            if (colon != NULL) {
+                *colon = '\0';
+                mcast_port = (in_port_t)atoi(colon + 1);
+            }
+            break;
+        case 'I': // マルチキャストに使うインタフェース (クライアントでも指定できる)
+            Mcast_iface = optarg;
+            break;
+        case 'w': // 送信をまとめる時間(マイクロ秒)
+            Flush_window_us = atol(optarg);
+            break;
+        case 'r': // クライアントごとの1秒あたりのPOST数の上限
+            Rate_limit = atof(optarg);
+            break;
+        case 'b': // 流量制限のバースト
+            Rate_burst = atof(optarg);
+            break;
+        case 'l': // チャットログの出力先ディレクトリ
+            log_dir = optarg;
+            break;
+        case 'i': // fdatasyncの間隔(ミリ秒)
+            sync_ms = atoi(optarg);
+            break;
+        case 'U': // 無停止入れ替えに使うUnixソケットのパス
+            Upgrade_path = optarg;
+            break;
+        case 'R': // ログを再生して終了する
+            if (chatlog_replay(optarg, print_record, NULL) < 0) {
+                exit(EXIT_FAILURE);
+            }
+            exit(EXIT_SUCCESS);
+        case '?':
+            fprintf(stderr, "Unknown option '%c'\n", optopt);
+        case 'h':
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind < 1 || argc - optind > 2) {
+        print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
     char username[16];
-    strncpy(username, argv[1], 15);
+    strncpy(username, argv[optind], 15);
     username[15] = '\0';
-    in_port_t port_number = (argc == 3) ? (in_port_t)atoi(argv[2]) : DEFAULT_PORT;
+    in_port_t port_number = (argc - optind == 2) ? (in_port_t)atoi(argv[optind + 1]) : DEFAULT_PORT;
 
     // Display program banner
     printf("Task5 (22122063) Naimi Nafis\n");
@@ -270,18 +821,22 @@ int main(int argc, char *argv[]) {
     broadcast_adrs.sin_port = htons(DEFAULT_PORT); // ブロードキャストには常にサーバポートを使用
     broadcast_adrs.sin_addr.s_addr = htonl(INADDR_BROADCAST);
 
-    // HELOパケットを送信し、HERE応答を待ちます
+    // 同じ -U で古いサーバが動いていれば、それを引き継ぐサーバになる
+    int handoff_conn = Upgrade_path != NULL ? handoff_connect(Upgrade_path) : -1;
+
+    // HELOパケットを送信し、HERE応答を待ちます (連合モードでは常にサーバになる)
     char server_ip[20];
-    int server_found = broadcast_helo(udp_sock, &broadcast_adrs, server_ip, sizeof(server_ip));
+    in_port_t server_port = DEFAULT_PORT;
+    int server_found = handoff_conn == -1 && !Federated && broadcast_helo(udp_sock, &broadcast_adrs, server_ip, sizeof(server_ip), &server_port);
 
     if (server_found) {
         // クライアントとしての動作
-        int tcp_sock = init_tcpclient(server_ip, DEFAULT_PORT);
+        int tcp_sock = init_tcpclient(server_ip, server_port);
 
         // JOINメッセージを送信します
         char joinMsg[BUFSIZE];
         snprintf(joinMsg, sizeof(joinMsg), "JOIN %s", username);
-        send(tcp_sock, joinMsg, strlen(joinMsg), 0);
+        send_message(tcp_sock, joinMsg);
 
         // クライアント操作を処理します
         handle_client(tcp_sock, username);
@@ -290,15 +845,51 @@ int main(int argc, char *argv[]) {
         ClientInfo clients[MAX_CLIENTS];
         init_client_array(clients);
 
-        // UDPサーバソケットの初期化
-        udp_sock = init_udpserver(DEFAULT_PORT);
-        set_nonblocking(udp_sock);
-
         // TCPサーバソケットの初期化
-        int tcp_sock = init_tcpserver(DEFAULT_PORT, MAX_CLIENTS);
+        Tcp_port = port_number;
+        int tcp_sock = -1, handed_udp = -1;
+        uint64_t mcast_seq = 0;
+        if (handoff_conn != -1) {
+            mcast_seq = take_over(handoff_conn, clients, &tcp_sock, &handed_udp);
+            close(handoff_conn);
+        } else {
+            tcp_sock = init_tcpserver(Tcp_port, MAX_CLIENTS);
+        }
         set_nonblocking(tcp_sock);
 
+        // UDPサーバソケットの初期化 (連合モードではPEER告知の前にTCPの待ち受けを始めておく)
+        close(udp_sock);
+        if (Federated) {
+            if (handed_udp != -1) close(handed_udp); // 連合モードではPEERと共有できるソケットを作り直す
+            udp_sock = federation_init(DEFAULT_PORT, Tcp_port);
+        } else {
+            udp_sock = handed_udp != -1 ? handed_udp : init_udpserver(DEFAULT_PORT);
+        }
+        set_nonblocking(udp_sock);
+
+        if (Multicast && mcast_server_init(mcast_group, mcast_port, Mcast_iface) == -1) {
+            exit(EXIT_FAILURE);
+        }
+        if (Multicast && mcast_seq > 0) {
+            mcast_resume(mcast_seq);
+        }
+
+        if (log_dir != NULL) {
+            if (chatlog_open(log_dir, sync_ms) == -1) {
+                exit(EXIT_FAILURE);
+            }
+            Logging = 1;
+            Log_dir = log_dir;
+            Log_sync_ms = sync_ms;
+        }
+
+        if (Upgrade_path != NULL) {
+            Handoff_sock = handoff_server(Upgrade_path);
+        }
+
         handle_server(udp_sock, tcp_sock, clients, username);
+
+        if (Logging) chatlog_close();
     }
 
     return 0;
@@ -0,0 +1,14 @@
+#ifndef TASK5_H_
+#define TASK5_H_
+/*
+  task5.h
+*/
+#include "mynet.h"
+
+#define BUFSIZE 512
+#define DEFAULT_PORT 50001
+
+/* ソケットをノンブロッキングモードに設定する */
+void set_nonblocking(int sock);
+
+#endif /* TASK5_H_ */
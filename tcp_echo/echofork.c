@@ -4,6 +4,18 @@
 #define PRCS_LIMIT 10 /* プロセス数制限 */
 #define BUFSIZE 50   /* バッファサイズ */
 
+/* 回収した子プロセスのスロットを空ける (sb_exit() の前に異常終了した場合のため) */
+static void release_slot(sb_board *board, pid_t pid)
+{
+  int i;
+
+  for( i = 0; i < board->n_slots; i++ ){
+    if( board->slot[i].pid == pid && board->slot[i].state != SB_EMPTY ){
+      sb_exit(&board->slot[i]);
+    }
+  }
+}
+
 int main(int argc, char *argv[])
 {
   int port_number;
@@ -12,39 +24,98 @@ int main(int argc, char *argv[])
   pid_t child;
   char buf[BUFSIZE];
   int strsize;
+  int use_splice = 0;
+  int follow_cpu = 0;
+  int c, cpu, slot;
+  long echoed;
+  echo_pipe ep;
+  char *sb_path = NULL;
+  sb_board *board;
+  sb_slot *sb;
 
-  /* 引数のチェックと使用法の表示 */
-  if( argc != 2 ){
-    fprintf(stderr,"Usage: %s Port_number\n", argv[0]);
+  /* 引数のチェックと使用法の表示
+     -s: spliceでカーネル内エコー
+     -c: 接続のパケットを受けたCPU (SO_INCOMING_CPU) で子プロセスを動かす
+     -S: スコアボードのファイル (../task3/sbview で見られる) */
+  while( (c = getopt(argc, argv, "scS:")) != -1 ){
+    switch( c ){
+    case 's':
+      use_splice = 1;
+      break;
+    case 'c':
+      follow_cpu = 1;
+      break;
+    case 'S':
+      sb_path = optarg;
+      break;
+    default:
+      argc = 0;
+    }
+  }
+  if( argc - optind != 1 ){
+    fprintf(stderr,"Usage: %s [-s] [-c] [-S scoreboard] Port_number\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  port_number = atoi(argv[1]);
+  port_number = atoi(argv[optind]);
 
   /* サーバの初期化 */
   sock_listen = init_tcpserver(port_number, 5);
 
+  /* 子プロセスは同時にPRCS_LIMIT個までなので、スロットも同じ数だけ用意する */
+  if( (board = sb_create(sb_path, PRCS_LIMIT)) == NULL ){
+    exit_errmesg("sb_create()");
+  }
+
   for(;;){
 
     /* クライアントの接続を受け付ける */
     sock_accepted = accept(sock_listen, NULL, NULL);
 
+    /* 空いているスロットを子プロセスに割り当てる (n_process < PRCS_LIMIT なので必ずある) */
+    for( slot = 0; board->slot[slot].state != SB_EMPTY; slot++ );
+    sb = &board->slot[slot];
+    sb_start(sb, 0);
+
     if( (child=fork()) == 0 ){
       /* Child process */
-      close(sock_accepted);
-      do{
-	/* 文字列をクライアントから受信する */
-	if((strsize=recv(sock_accepted, buf, BUFSIZE, 0)) == -1){
-	  exit_errmesg("recv()");
+      close(sock_listen);
+      sb_start(sb, getpid());
+      sb_begin(sb, sock_accepted);
+      if( follow_cpu && (cpu = incoming_cpu(sock_accepted)) >= 0 ){
+	pin_cpu(cpu);
+      }
+      if( use_splice ){
+	/* パイプを経由して、ユーザ空間にコピーせずに送り返す */
+	if( echo_pipe_init(&ep) == -1 ){
+	  exit_errmesg("pipe()");
 	}
-
-	/* 文字列をクライアントに送信する */
-	if(send(sock_accepted, buf, strsize, 0) == -1 ){
-	  exit_errmesg("send()");
+	if( (echoed = splice_echo(&ep, sock_accepted)) == -1 ){
+	  exit_errmesg("splice()");
 	}
-      }while( buf[strsize-1] != '\n' ); /* 改行コードを受信するまで繰り返す */
+	sb_add(sb, echoed);
+      }
+      else{
+	do{
+	  /* 文字列をクライアントから受信する */
+	  if((strsize=recv(sock_accepted, buf, BUFSIZE, 0)) == -1){
+	    exit_errmesg("recv()");
+	  }
+	  if( strsize == 0 ){
+	    break; /* 改行の前に切断された */
+	  }
+
+	  /* 文字列をクライアントに送信する */
+	  if(send(sock_accepted, buf, strsize, 0) == -1 ){
+	    exit_errmesg("send()");
+	  }
+	  sb_add(sb, strsize);
+	}while( buf[strsize-1] != '\n' ); /* 改行コードを受信するまで繰り返す */
+      }
 
       close(sock_accepted);
+      sb_end(sb);
+      sb_exit(sb);
       exit(EXIT_SUCCESS);
     }
     else if( child >0 ){
@@ -62,10 +133,12 @@ int main(int argc, char *argv[])
     /* ゾンビプロセスの回収 */
     if( n_process == PRCS_LIMIT ){
       child=wait(NULL); /* 制限数を超えたら 空きが出るまでブロック */
+      release_slot(board, child);
       n_process--;
     }
 
     while( (child=waitpid(-1, NULL, WNOHANG ))>0 ){
+      release_slot(board, child);
       n_process--;
     }
 
@@ -6,6 +6,9 @@
 
 void * echo_thread(void *arg);
 
+int use_splice = 0; /* -s: spliceでカーネル内エコー */
+int follow_cpu = 0; /* -c: 接続のパケットを受けたCPU (SO_INCOMING_CPU) でスレッドを動かす */
+
 /* スレッド関数の引数 */
 struct myarg {
   int sock; /* acceptしたソケット */
@@ -21,12 +24,24 @@ int main(int argc, char *argv[])
   pthread_t tid;
 
   /* 引数のチェックと使用法の表示 */
-  if( argc != 2 ){
-    fprintf(stderr,"Usage: %s Port_number\n", argv[0]);
+  while( (i = getopt(argc, argv, "sc")) != -1 ){
+    switch( i ){
+    case 's':
+      use_splice = 1;
+      break;
+    case 'c':
+      follow_cpu = 1;
+      break;
+    default:
+      argc = 0;
+    }
+  }
+  if( argc - optind != 1 ){
+    fprintf(stderr,"Usage: %s [-s] [-c] Port_number\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  port_number = atoi(argv[1]); /* 引数の取得 */
+  port_number = atoi(argv[optind]); /* 引数の取得 */
 
   /* サーバの初期化 */
   sock_listen = init_tcpserver(port_number, 5);
@@ -59,11 +74,35 @@ void * echo_thread(void *arg)
 {
   struct myarg *tharg;
   char r_buf[BUFSIZE], s_buf[BUFSIZE];
-  int strsize;
+  int strsize, cpu;
 
   tharg = (struct myarg *)arg;
   pthread_detach(pthread_self()); /* スレッドの分離(終了を待たない) */
 
+  if( follow_cpu && (cpu = incoming_cpu(tharg->sock)) >= 0 ){
+    pin_cpu(cpu);
+  }
+
+  if( use_splice ){
+    echo_pipe ep;
+
+    /* 受信データに手を加えられないので、スレッド番号はセッションの最初に1回だけ送る */
+    snprintf(s_buf, BUFSIZE, "[Thread #%d] ", tharg->id);
+    if( send(tharg->sock, s_buf, strlen(s_buf), 0) == -1 ){
+      exit_errmesg("send()");
+    }
+    if( echo_pipe_init(&ep) == -1 ){
+      exit_errmesg("pipe()");
+    }
+    if( splice_echo(&ep, tharg->sock) == -1 ){
+      exit_errmesg("splice()");
+    }
+    echo_pipe_close(&ep);
+    close(tharg->sock);
+    free(tharg);
+    return(NULL);
+  }
+
   do{
     /* 文字列をクライアントから受信する */
     if((strsize=recv(tharg->sock, r_buf, BUFSIZE, 0)) == -1){